@@ -28,7 +28,19 @@
  * \brief mcdreplace memcache replace
  * \brief mcdappend memcache append to string variable
  * \brief mcddelete memcache delete
+ * \brief mcdnsbump memcache namespace invalidation (generation bump)
+ * \brief mcdsavevars / mcdloadvars save and restore a set of channel variables in a single item
  * \brief MCDCOUNTER() memcache numeric counter set, test and increment/decrement
+ * \brief MCDCACHE() read-through cache, with stampede protection
+ * \brief memcached sorcery wizard, a cache layer shared between asterisk servers
+ * \brief memcached show hotkeys: sampled report of the most accessed keys and key prefixes
+ * \brief MCDTRACE() per-channel timing of the memcached operations
+ * \brief named clusters of servers, selected by key suffix, dialplan variable or key prefix
+ * \brief replicated writes and nearest-replica reads between two clusters
+ * \brief embedded in-process store, as a cluster backend or as a fallback for unreachable servers
+ * \brief connection warm-up at load time, and background keepalive probes
+ * \brief hash tags, to keep the related keys on the same server
+ * \brief memcached show servers / MemcachedServers AMI action: server statistics and response times
  *
  * \author\verbatim Radu Maierean <radu dot maierean at gmail> \endverbatim
  * 
@@ -51,8 +63,15 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 200656 $")
 #include "asterisk/module.h"
 #include "asterisk/app.h"
 #include "asterisk/utils.h"
+#include "asterisk/strings.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/sorcery.h"
+#include "asterisk/cli.h"
+#include "asterisk/datastore.h"
+#include "asterisk/manager.h"
 
 #include <stdlib.h>
+#include <ctype.h>
 #include <libmemcached-1.0/memcached.h>
 #include <libmemcachedutil-1.0/util.h>
 
@@ -69,6 +88,10 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 200656 $")
 		<description>
 			<para>gets or sets the value for a key in the cache store. when used in write mode, 
 			the function invokes the set memcached command.</para>
+			<para>when named clusters are configured, a key written as key@cluster is sent to 
+			that cluster; otherwise the MCDCLUSTER dialplan variable, or the route= prefixes 
+			in the configuration file, select the cluster. this applies to all the apps and 
+			functions of the module.</para>
 		</description>
 		<see-also>
 			<ref type="application">mcdadd</ref>
@@ -208,6 +231,73 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 200656 $")
 			<ref type="function">MCD</ref>
 			<ref type="application">mcdadd</ref>
 			<ref type="application">mcdreplace</ref>
+			<ref type="application">mcdnsbump</ref>
+		</see-also>
+	</application>
+	<application name="mcdnsbump" language="en_US">
+		<synopsis>
+			invalidates all the keys in a namespace, in a single operation
+		</synopsis>
+		<syntax>
+			<parameter name="namespace" required="true">
+				<para>the namespace to invalidate</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>when namespaces are enabled in the config file, a key written as ns:key belongs 
+			to the namespace ns. the module keeps a generation number for each namespace in the 
+			cache store, and uses it as part of the real key. this app increments the generation 
+			number, so that all the keys previously stored in the namespace become unreachable, and 
+			will eventually be expired or evicted by the memcached server. other asterisk servers 
+			sharing the cache store notice the change once their locally cached generation number 
+			expires (see namespace_cache in the config file).</para>
+		</description>
+		<see-also>
+			<ref type="function">MCD</ref>
+			<ref type="application">mcddelete</ref>
+		</see-also>
+	</application>
+	<application name="mcdsavevars" language="en_US">
+		<synopsis>
+			saves a set of channel variables in the cache store, as a single value
+		</synopsis>
+		<syntax>
+			<parameter name="key" required="true">
+				<para>key to store the variables at</para>
+			</parameter>
+			<parameter name="vars" required="true">
+				<para>the names of the variables, separated by &amp;; a name ending in * 
+				stands for all the channel variables starting with it</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>saves the names and the values of the variables in a single value in the cache 
+			store, so that another asterisk server can restore them all with a single lookup, 
+			using mcdloadvars. variables that are not set are skipped. the time-to-live is set like 
+			for mcdset (MCDTTL, or the config file).</para>
+		</description>
+		<see-also>
+			<ref type="application">mcdloadvars</ref>
+			<ref type="application">mcdset</ref>
+		</see-also>
+	</application>
+	<application name="mcdloadvars" language="en_US">
+		<synopsis>
+			restores on the channel the variables saved with mcdsavevars
+		</synopsis>
+		<syntax>
+			<parameter name="key" required="true">
+				<para>key the variables were saved at</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>sets on the channel all the variables saved at the key with mcdsavevars. if the 
+			value at the key is not a snapshot of variables (or is damaged), no variable is set, 
+			and MCDRESULT is 122.</para>
+		</description>
+		<see-also>
+			<ref type="application">mcdsavevars</ref>
+			<ref type="application">mcdget</ref>
 		</see-also>
 	</application>
 	<function name="MCDCOUNTER" language="en_US">
@@ -236,6 +326,67 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 200656 $")
 			<ref type="application">mcddelete</ref>
 		</see-also>
 	</function>
+	<function name="MCDCACHE" language="en_US">
+		<synopsis>
+			returns the value for a key in the cache store; on a miss, computes it with the 
+			fallback expression and stores it.
+		</synopsis>	
+		<syntax>
+			<parameter name="key" required="true">
+				<para>key to be looked up</para>
+			</parameter>
+			<parameter name="ttl" required="true">
+				<para>time to live, in seconds, for the value computed by the fallback expression</para>
+			</parameter>
+			<parameter name="fallback" required="true">
+				<para>dialplan function call that computes the value, written without the 
+				surrounding ${ }, e.g. ODBC_ROUTE(${EXTEN})</para>
+			</parameter>
+			<parameter name="stale">
+				<para>number of seconds past the ttl during which the old value is still returned, 
+				while a single caller refreshes it; default is 0 (no stale values)</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>returns the value for a key in the cache store. when the key is missing, the 
+			fallback expression is evaluated and its result is stored at the key and returned. 
+			concurrent calls missing the same key on this asterisk server wait for a single 
+			evaluation of the fallback; across servers, the evaluation is guarded by a lease key 
+			(see cache_lease in the config file). when a stale period is given, a value whose ttl 
+			passed is still returned for that long, while one caller refreshes it.</para>
+		</description>
+		<see-also>
+			<ref type="function">MCD</ref>
+		</see-also>
+	</function>
+	<function name="MCDTRACE" language="en_US">
+		<synopsis>
+			turns on or off the timing of every memcached operation on the channel
+		</synopsis>	
+		<syntax />
+		<description>
+			<para>when set to a true value, every memcached operation executed on the channel is 
+			logged, with its key, server, duration, value size and result; a false value turns 
+			the tracing off. when read, returns the number of operations traced so far, their 
+			total and maximum duration, as ops=N total=Nus max=Nus.</para>
+		</description>
+	</function>
+	<manager name="MemcachedServers" language="en_US">
+		<synopsis>
+			lists the memcached servers, with their statistics
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+		</syntax>
+		<description>
+			<para>sends a MemcachedServer event for every server of every cluster, with the 
+			statistics returned by the server (hits, misses, items, connections, memory, 
+			evictions, and the evictions per second since the previous report), next to the 
+			operations, errors and response times seen from this asterisk server, and the 
+			keepalive probes of its cluster; then a MemcachedServersComplete event. the same 
+			report is shown by the CLI command 'memcached show servers'.</para>
+		</description>
+	</manager>
  ***/
 
 /*
@@ -257,11 +408,60 @@ hash=default                          ; hashing mode (see libmemcached documenta
 keyprefix=                            ; whatever string you specify here is prepended to each key that is retrieved
                                       ;   or stored, so that you can create some sort of a "domain" for your
                                       ;   asterisk server
+;namespaces=no                        ; when enabled, a key written as ns:key belongs to the namespace 'ns'; the
+                                      ;   keys of a namespace can be invalidated all at once with mcdnsbump(ns)
+;namespace_cache=1000                 ; how long (in milliseconds) a namespace generation number is cached locally
+                                      ;   before being looked up again in the cache store
+;cache_lease=10                       ; for MCDCACHE(), how long (in seconds) one caller may take to compute a missing
+                                      ;   value before the others stop waiting for it
+;sorcery_expire=300                   ; time-to-live, in seconds, of the objects cached by the memcached sorcery wizard;
+                                      ;   can be overridden per object type in sorcery.conf, e.g.
+                                      ;   endpoint/cache=memcached,expire=60
+;hotkey_sample=100                    ; one in this many operations is sampled for the 'memcached show hotkeys' CLI
+                                      ;   report; 0 turns the sampling off
+;slow_threshold=100                   ; operations taking longer than this many milliseconds are logged as warnings;
+                                      ;   0 turns the slow operation log off
+;slow_log_rate=10                     ; no more than this many slow operations are logged per second
+;replica_queue=10000                  ; how many writes may wait to be copied to the replica clusters; beyond
+                                      ;   that, writes are not replicated (see 'memcached show replicas')
+;backend=memcached                    ; 'embedded' keeps the keys in the memory of asterisk itself instead of
+                                      ;   memcached servers (for a single server, or for testing); also valid in
+                                      ;   the sections of the named clusters
+;embedded_fallback=no                 ; when the server of a key cannot be reached (refused or marked dead), serve
+                                      ;   the operations on that key from the embedded store (whose content is
+                                      ;   local to this asterisk server)
+;embedded_memory=64                   ; memory of the embedded store, in megabytes
+;pool_size=1                          ; how many connections (to every server) the cluster keeps; as many calls
+                                      ;   can talk to the servers at the same time. all of them are opened when
+                                      ;   the module loads; also valid in the sections of the named clusters
+;keepalive=30                         ; every this many seconds, the connection idle for the longest is probed (and
+                                      ;   reopened if broken) by a background thread, provided another one stays
+                                      ;   idle for the calls (so never with pool_size=1); 0 turns the probes off
+;probe_timeout=250                    ; how long (in milliseconds) a probe waits for a server to answer
+;hash_tags=no                         ; pick the server of a key from the part between { and } only, so that
+                                      ;   {call123}:state and {call123}:legs are kept on the same server; also
+                                      ;   valid in the sections of the named clusters
 server=localhost:11211                ; multiple 'server=' entries will create a cluster of servers to connect to;
 ;server=memcache.server.com:11211     ;   each entry is in the form host[:port], host being a fqdn or an ip address,
                                       ;   the default memcached port is 11211. if no entries, the module will at
                                       ;   least attempt to connect to a memcached running on the localhost
 
+; every section other than [general] defines a named cluster of servers, with its own connection pool.
+; a key is sent to a named cluster when written as key@cluster, when the MCDCLUSTER dialplan variable
+; holds the name of the cluster, or when it starts with one of the route= prefixes of the cluster;
+; all the other keys go to the servers in [general]
+;[counters]
+;server=counters1.example.com:11211   ; the servers of this cluster, same as in [general]
+;server=counters2.example.com:11211
+;ttl=3600                             ; default time-to-live for this cluster; when missing, the one in [general]
+;keyprefix=                           ; key prefix for this cluster only
+;route=cnt_                           ; keys starting with cnt_ go to this cluster; several route= lines allowed,
+                                      ;   the longest matching prefix wins
+;replica=counters_b                   ; writes to this cluster are also copied, in the background, to the cluster
+                                      ;   [counters_b]; reads go to either of them, and try the other one on a miss
+;replica_reads=nearest                ; which one of the two is read first: 'nearest' (the one that answered
+                                      ;   faster lately), 'primary' or 'replica'
+
 UNIT TESTING (using a dialplan macro)
 =====================================
 [macro-mcdtest]
@@ -289,6 +489,22 @@ exten => s,n,noop(>>>> test 8 (counter set & readout): ${MCDCOUNTER(counter)})
 exten => s,n,noop(>>>> test 9 (counter decrement by 12): ${MCDCOUNTER(counter,-12)})
 exten => s,n,wait(2)
 exten => s,n,noop(>>>> test 10 (counter expiration): ${MCDCOUNTER(counter)} / error: ${MCDRESULT})
+exten => s,n,set(MCD(tenant:wrtest)=hello)                 ; needs namespaces=yes
+exten => s,n,noop(>>>> test 11 (namespaced write / read): '${MCD(tenant:wrtest)}' == 'hello')
+exten => s,n,mcdnsbump(tenant)
+exten => s,n,set(testresult=${MCD(tenant:wrtest)})
+exten => s,n,noop(>>>> test 12 (namespace invalidation): error: ${MCDRESULT} == 16)
+exten => s,n,mcddelete(cachetest)
+exten => s,n,noop(>>>> test 13 (read-through miss): '${MCDCACHE(cachetest,60,EVAL(computed))}' == 'computed')
+exten => s,n,noop(>>>> test 14 (read-through hit): '${MCD(cachetest)}' == 'computed')
+exten => s,n,set(MCD(wrtest@counters)=elsewhere)         ; needs a [counters] cluster
+exten => s,n,noop(>>>> test 15 (named cluster): '${MCD(wrtest@counters)}' == 'elsewhere', '${MCD(wrtest)}' == '')
+exten => s,n,set(handoff_a=one)
+exten => s,n,set(handoff_b=two)
+exten => s,n,mcdsavevars(varstest,handoff_*)
+exten => s,n,set(handoff_a=)
+exten => s,n,mcdloadvars(varstest)
+exten => s,n,noop(>>>> test 16 (variables snapshot): '${handoff_a}${handoff_b}' == 'onetwo')
 exten => s,n,hangup()
 */
 
@@ -298,16 +514,227 @@ static char *app_mcdadd =         "mcdadd";
 static char *app_mcdreplace =     "mcdreplace";
 static char *app_mcdappend =      "mcdappend";
 static char *app_mcddelete =      "mcddelete";
+static char *app_mcdnsbump =      "mcdnsbump";
+static char *app_mcdsavevars =    "mcdsavevars";
+static char *app_mcdloadvars =    "mcdloadvars";
 
 #define CONFIG_FILE_NAME          "memcached.conf"
 #define MAX_ASTERISK_VARLEN       4096
 
 // memcache properties
 struct timespec to;
-memcached_pool_st *mcdpool;
-char keyprefix[65];
 static int use_binary_proto;
-static unsigned int mcdttl;
+
+// clusters: [general] and every other section of the config file define a cluster of servers, 
+// with its own pool of connections; a key is sent to a cluster by its @cluster suffix, by the 
+// MCDCLUSTER dialplan variable, or by the longest matching route= prefix, in this order
+#define DEFAULT_CLUSTER_NAME      "general"
+struct mcd_cluster {
+	char name[64];
+	memcached_pool_st *pool;
+	unsigned int ttl;
+	struct mcd_cluster *replica;  // secondary cluster the writes are copied to, if any
+	char replica_name[64];
+	int replica_reads;            // REPLICA_READS_*
+	// replication counters and read latency (exponentially weighted average), guarded by repl_lock
+	unsigned long reads, read_fallbacks;
+	unsigned long repl_queued, repl_done, repl_failed, repl_dropped;
+	int64_t rtt_us, lag_us, max_lag_us;
+	struct mcd_store *store;      // embedded store, for backend=embedded or embedded_fallback=yes
+	unsigned int pool_size;
+	int hash_tags;
+	// keepalive probes, only touched by the keepalive thread (and at startup)
+	int probe_failing;
+	unsigned long probes, probe_failures, reconnects;
+	// per-server figures seen from here, by position of the server in the cluster
+	struct mcd_server_stats *server_stats;
+	unsigned int nservers;
+	volatile int stats_ticks;
+	ast_mutex_t stats_lock;
+	AST_LIST_ENTRY(mcd_cluster) list;
+};
+struct mcd_route {
+	char prefix[MEMCACHED_MAX_KEY];
+	size_t len;
+	struct mcd_cluster *cluster;
+	AST_LIST_ENTRY(mcd_route) list;
+};
+static AST_LIST_HEAD_NOLOCK_STATIC(mcd_clusters, mcd_cluster);
+static AST_LIST_HEAD_NOLOCK_STATIC(mcd_routes, mcd_route);
+static struct mcd_cluster *default_cluster;
+static int cluster_count;
+
+// replication: successful writes to a cluster with a replica= are queued, and copied to the 
+// replica by a background thread; reads go to whichever of the two answered faster lately, and 
+// try the other one on a miss or an error
+#define REPLICA_READS_NEAREST     0
+#define REPLICA_READS_PRIMARY     1
+#define REPLICA_READS_REPLICA     2
+#define REPL_FETCH_WAIT_MS        1000   // how long the replication worker waits for a connection of the replica
+#define REPL_FETCH_ATTEMPTS       3      // and how many times, before counting the write as failed
+#define REPLICA_PROBE_EVERY       32     // one in this many reads goes to the slower one, to measure it
+struct mcd_repl_op {
+	struct mcd_cluster *cluster;
+	const char *cmd;
+	time_t ttl;
+	struct timeval queued;
+	AST_LIST_ENTRY(mcd_repl_op) list;
+	char key[MEMCACHED_MAX_KEY];
+	size_t len;
+	char value[0];
+};
+static AST_LIST_HEAD_NOLOCK_STATIC(mcd_repl_queue, mcd_repl_op);
+AST_MUTEX_DEFINE_STATIC(repl_lock);
+static ast_cond_t repl_cond;
+static pthread_t repl_thread = AST_PTHREADT_NULL;
+static int repl_stop;
+static unsigned int repl_queue_len, replica_queue;
+
+// embedded store: an in-process stand-in for the servers of a cluster (backend=embedded), or for 
+// the keys whose server cannot be reached (embedded_fallback=yes). items live in STORE_SHARDS hash 
+// tables, each with its own lock and its own share of the memory; that memory is cut in pages, 
+// and every page in chunks of one slab class. a class with no free chunk gets a new page while 
+// the memory limit allows, then evicts its least recently used item, and as a last resort takes 
+// over a page from the class holding the most of them
+#define STORE_SHARDS              8
+#define STORE_PAGE_SIZE           65536
+#define STORE_SLAB_CLASSES        32
+#define STORE_MIN_CHUNK           64
+#define STORE_INITIAL_BUCKETS     1024
+#define STORE_RELATIVE_TTL_MAX    2592000    // as in memcached, a longer ttl is a unix time
+#define MCD_UNREACHABLE(rc)       (((rc) == MEMCACHED_NO_SERVERS) || ((rc) == MEMCACHED_SERVER_MARKED_DEAD) \
+                                  || ((rc) == MEMCACHED_SERVER_TEMPORARILY_DISABLED) || ((rc) == MEMCACHED_CONNECTION_FAILURE))
+struct mcd_item {
+	struct mcd_item *hnext;        // hash chain
+	struct mcd_item *prev, *next;  // lru of the slab class while used, free list otherwise
+	time_t exptime;
+	uint32_t flags;
+	uint32_t hash;
+	uint32_t nvalue;
+	uint16_t nkey;
+	uint8_t cls;
+	uint8_t used;
+	char data[];                   // the key, then the value and a terminating 0
+};
+struct mcd_slab_class {
+	size_t size;
+	unsigned int pages;
+	struct mcd_item *free;
+	struct mcd_item *lru_head, *lru_tail;
+};
+struct mcd_store_shard {
+	ast_mutex_t lock;
+	struct mcd_item **buckets;
+	unsigned int nbuckets, nitems;
+	struct mcd_slab_class classes[STORE_SLAB_CLASSES];
+	int nclasses;
+	char **pages;
+	unsigned char *page_cls;
+	unsigned int npages, maxpages;
+	unsigned long hits, misses, evictions, expired, reassigned;
+};
+struct mcd_store {
+	struct mcd_store_shard shards[STORE_SHARDS];
+};
+
+// connections: every cluster opens pool_size connections to each of its servers when loaded, and 
+// a background thread probes an idle one every keepalive seconds, reopening it when broken
+static unsigned int keepalive, probe_timeout;
+AST_MUTEX_DEFINE_STATIC(keepalive_lock);
+static ast_cond_t keepalive_cond;
+static pthread_t keepalive_thread = AST_PTHREADT_NULL;
+static int keepalive_stop;
+
+// namespace generations: the generation number of a namespace is kept in the cache store 
+// at the key "<ns>:#gen", and cached locally for namespace_cache milliseconds
+#define NSGEN_KEY_SUFFIX          ":#gen"
+#define NSGEN_CACHE_SLOTS         64
+struct mcd_nsgen {
+	struct mcd_cluster *cluster;
+	char ns[MEMCACHED_MAX_KEY];
+	uint64_t gen;
+	struct timeval expires;
+};
+static int use_namespaces;
+static unsigned int nsgen_cache_ms;
+static struct mcd_nsgen nsgen_cache[NSGEN_CACHE_SLOTS];
+AST_MUTEX_DEFINE_STATIC(nsgen_lock);
+
+// MCDCACHE() flights: concurrent misses on the same key wait for the one caller that evaluates 
+// the fallback; across servers, the evaluation is guarded by a lease stored at "<key>:#lease"
+#define CACHE_LEASE_SUFFIX        ":#lease"
+#define CACHE_LEASE_POLL_MS       50
+struct mcd_flight {
+	struct mcd_cluster *cluster;
+	char key[MEMCACHED_MAX_KEY];
+	int refs;
+	int done;
+	char value[MAX_ASTERISK_VARLEN];
+	ast_cond_t cond;
+	AST_LIST_ENTRY(mcd_flight) list;
+};
+static AST_LIST_HEAD_NOLOCK_STATIC(mcd_flights, mcd_flight);
+AST_MUTEX_DEFINE_STATIC(flights_lock);
+static unsigned int cache_lease;
+
+// sorcery wizard: objects are cached at "sorcery:<type>:<id>", as their object set serialized 
+// into <length>:<name><length>:<value> pairs
+#define SORCERY_KEY_PREFIX        "sorcery:"
+struct mcd_sorcery_type {
+	unsigned int expire;
+};
+static unsigned int sorcery_expire;
+
+// variables snapshots (mcdsavevars / mcdloadvars): "MCV", a format version byte, then the name and 
+// the value of every variable, each preceded by its length on two bytes (big endian)
+#define VARS_MAGIC                "MCV"
+#define VARS_FORMAT_VERSION       1
+
+// hot keys: one in hotkey_sample operations is fed into two space-saving summaries, one by key 
+// and one by key prefix (the key up to its first non-alphanumeric character)
+#define HOTKEY_SLOTS              64
+struct mcd_hotkey {
+	char key[MEMCACHED_MAX_KEY];
+	unsigned long count;          // estimated number of samples (over-estimated by at most 'error')
+	unsigned long error;
+	unsigned long samples;        // samples actually seen since the key got its slot
+	unsigned long long bytes;
+	size_t maxbytes;
+};
+struct mcd_hotkeys {
+	struct mcd_hotkey slots[HOTKEY_SLOTS];
+	int used;
+};
+static struct mcd_hotkeys hotkeys, hotprefixes;
+static unsigned int hotkey_sample;
+static unsigned long hotkey_sampled;
+static volatile int hotkey_ticks;
+AST_MUTEX_DEFINE_STATIC(hotkeys_lock);
+
+// slow operations log, and per-channel tracing (MCDTRACE() attaches a datastore to the channel; 
+// trace_channels counts them, so that nothing is looked up while nobody traces)
+struct mcd_trace {
+	unsigned long ops;
+	int64_t total_us;
+	int64_t max_us;
+};
+static unsigned int slow_threshold;
+static unsigned int slow_log_rate;
+static time_t slow_log_second;
+static unsigned int slow_logged, slow_suppressed;
+static volatile int trace_channels;
+AST_MUTEX_DEFINE_STATIC(slow_log_lock);
+
+// per-server figures seen from here, for 'memcached show servers' and the MemcachedServers AMI 
+// action: response times, sampled in one of SERVER_STATS_SAMPLE operations (like the hot keys), 
+// every error, and the evictions counted by the server at the last report
+#define SERVER_STATS_SAMPLE       16
+struct mcd_server_stats {
+	unsigned long samples, errors;
+	int64_t rtt_us, max_us;
+	unsigned long long evictions;
+	struct timeval checked;
+};
 
 /* 
   // returned errors in the MCDRESULT variable:
@@ -362,6 +789,7 @@ static unsigned int mcdttl;
 #define MEMCACHED_VALUE_TOO_LONG       125
 #define MEMCACHED_BAD_INCREMENT        124
 #define MEMCACHED_BINARY_PROTO_NEEDED  123
+#define MEMCACHED_BAD_SNAPSHOT         122
 
 static void mcd_set_operation_result(struct ast_channel *chan, int result) {
 	char *numresult = NULL;
@@ -369,205 +797,1934 @@ static void mcd_set_operation_result(struct ast_channel *chan, int result) {
 	pbx_builtin_setvar_helper(chan, "MCDRESULT", numresult);
 }
 
-static int mcd_load_config(void) {
-
-	// initialize the timeout that we wait for a memcached pool operation to complete
-	to.tv_sec = 0; to.tv_nsec = 500000;
-
-	struct ast_config *cfg;
-	struct ast_flags config_flags = { 0 };
+static uint32_t mcd_store_hash(const char *key, size_t len) {
+// fnv-1a
+	uint32_t hash = 2166136261u;
+	while (len--)
+		hash = (hash ^ (unsigned char)*key++) * 16777619u;
+	return hash;
+}
 
-	if (!(cfg = ast_config_load(CONFIG_FILE_NAME, config_flags))) {
-		ast_log(LOG_ERROR, "missing memcached resource config file '%s'\n", CONFIG_FILE_NAME);
-		return 1;
-	} else if (cfg == CONFIG_STATUS_FILEINVALID) {
-		ast_log(LOG_ERROR, "memcached resource config file '" CONFIG_FILE_NAME "' invalid format.\n");
-		return 1;
+static void mcd_store_destroy(struct mcd_store *store) {
+	int i;
+	unsigned int p;
+	for (i = 0; i < STORE_SHARDS; i++) {
+		struct mcd_store_shard *shard = &store->shards[i];
+		if (shard->pages)
+			for (p = 0; p < shard->npages; p++)
+				free(shard->pages[p]);
+		free(shard->pages);
+		free(shard->page_cls);
+		free(shard->buckets);
+		ast_mutex_destroy(&shard->lock);
 	}
+	free(store);
+}
 
-    // parse server names for memcached from the [general] section of the config file
-    char mcd_config[2048]; mcd_config[0] = 0;
-	struct ast_variable *serverentry = ast_variable_browse(cfg, "general");
-	for ( ; serverentry; serverentry = serverentry->next) {
-		if (strcasecmp(serverentry->name, "server") == 0) {
-	    	strcat(mcd_config, "--SERVER=");
-    		strcat(mcd_config, serverentry->value);
-    		strcat(mcd_config, " ");
+static struct mcd_store *mcd_store_create(size_t memory) {
+
+	struct mcd_store *store = ast_calloc(1, sizeof(*store));
+	if (!store)
+		return NULL;
+	int i;
+	for (i = 0; i < STORE_SHARDS; i++) {
+		struct mcd_store_shard *shard = &store->shards[i];
+		ast_mutex_init(&shard->lock);
+		shard->nbuckets = STORE_INITIAL_BUCKETS;
+		shard->maxpages = memory / STORE_SHARDS / STORE_PAGE_SIZE;
+		if (shard->maxpages == 0)
+			shard->maxpages = 1;
+		shard->buckets = ast_calloc(shard->nbuckets, sizeof(*shard->buckets));
+		shard->pages = ast_calloc(shard->maxpages, sizeof(*shard->pages));
+		shard->page_cls = ast_calloc(shard->maxpages, sizeof(*shard->page_cls));
+		// chunk sizes grow by 1/4, the last class holds a whole page
+		size_t size = STORE_MIN_CHUNK;
+		while ((size < STORE_PAGE_SIZE) && (shard->nclasses < STORE_SLAB_CLASSES - 1)) {
+			shard->classes[shard->nclasses++].size = size;
+			size = ((size + size / 4) + 7) & ~(size_t)7;
 		}
+		shard->classes[shard->nclasses++].size = STORE_PAGE_SIZE;
 	}
-    if (strstr(mcd_config, "--SERVER=") == 0) {
-        ast_log(LOG_DEBUG, "Expecting memcache server on 127.0.0.1\n");
-        strcpy(mcd_config, "--SERVER=127.0.0.1 ");
-    }
-    ast_log(LOG_DEBUG, "res_memcached configured servers: '%s'\n", mcd_config);
-//	strcat(mcd_config, "--SORT-HOSTS ");  not a good idea: turns out that the documentation says:
-//                                        "Enabling this will cause hosts that are added to be placed 
-//                                         in the host list in sorted order. This will defeat 
-//                                         consisten hashing."
+	for (i = 0; i < STORE_SHARDS; i++)
+		if (!store->shards[i].buckets || !store->shards[i].pages || !store->shards[i].page_cls) {
+			mcd_store_destroy(store);
+			return NULL;
+		}
+	return store;
 
-	mcdttl = 0;
-	const char *ttlvalue;
-	if ((ttlvalue = ast_variable_retrieve(cfg, "general", "ttl")))
-		mcdttl = atoi(ttlvalue);
-	ast_log(LOG_DEBUG, "default time to live for key-value entries set to %d seconds\n", mcdttl);
+}
 
-	use_binary_proto = 1;
-	const char *proto_mode;
-	if ((proto_mode = ast_variable_retrieve(cfg, "general", "binary_proto")))
-		use_binary_proto = ast_true(proto_mode);
-//	if (use_binary_proto)
-//		strcat(mcd_config, "--BINARY-PROTOCOL ");
-//	else
-//		ast_log(LOG_WARNING, "not using memcached binary protocol; MCDCOUNTER() function will be unavailable\n");
-/*
-	const char *hashmode;
-	if ((hashmode = ast_variable_retrieve(cfg, "general", "hash"))) {
-		strcat(mcd_config, "--HASH=");
-		strcat(mcd_config, hashmode);
-		strcat(mcd_config, " ");
+static void mcd_chunk_list_remove(struct mcd_item **head, struct mcd_item **tail, struct mcd_item *it) {
+	if (it->prev)
+		it->prev->next = it->next;
+	else
+		*head = it->next;
+	if (it->next)
+		it->next->prev = it->prev;
+	else if (tail)
+		*tail = it->prev;
+	it->prev = it->next = NULL;
+}
+
+static void mcd_chunk_free(struct mcd_slab_class *class, struct mcd_item *it) {
+	it->used = 0;
+	it->prev = NULL;
+	it->next = class->free;
+	if (class->free)
+		class->free->prev = it;
+	class->free = it;
+}
+
+static void mcd_item_unlink(struct mcd_store_shard *shard, struct mcd_item *it) {
+// takes an item out of the hash table and its lru, and gives its chunk back to the free list
+
+	struct mcd_item **pos = &shard->buckets[(it->hash >> 3) & (shard->nbuckets - 1)];
+	while (*pos && (*pos != it))
+		pos = &(*pos)->hnext;
+	if (*pos)
+		*pos = it->hnext;
+	struct mcd_slab_class *class = &shard->classes[it->cls];
+	mcd_chunk_list_remove(&class->lru_head, &class->lru_tail, it);
+	mcd_chunk_free(class, it);
+	shard->nitems--;
+
+}
+
+static void mcd_lru_push(struct mcd_slab_class *class, struct mcd_item *it) {
+	it->prev = NULL;
+	it->next = class->lru_head;
+	if (class->lru_head)
+		class->lru_head->prev = it;
+	class->lru_head = it;
+	if (!class->lru_tail)
+		class->lru_tail = it;
+}
+
+static void mcd_item_touch(struct mcd_store_shard *shard, struct mcd_item *it) {
+// moves an item to the head of its lru
+	struct mcd_slab_class *class = &shard->classes[it->cls];
+	if (class->lru_head == it)
+		return;
+	mcd_chunk_list_remove(&class->lru_head, &class->lru_tail, it);
+	mcd_lru_push(class, it);
+}
+
+static void mcd_item_link(struct mcd_store_shard *shard, struct mcd_item *it) {
+
+	// keep the chains short: double the table when it holds 1.5 items per bucket
+	if ((shard->nitems + 1) > shard->nbuckets + shard->nbuckets / 2) {
+		unsigned int nbuckets = shard->nbuckets * 2, b;
+		struct mcd_item **buckets = ast_calloc(nbuckets, sizeof(*buckets));
+		if (buckets) {
+			for (b = 0; b < shard->nbuckets; b++) {
+				struct mcd_item *cur, *next;
+				for (cur = shard->buckets[b]; cur; cur = next) {
+					next = cur->hnext;
+					cur->hnext = buckets[(cur->hash >> 3) & (nbuckets - 1)];
+					buckets[(cur->hash >> 3) & (nbuckets - 1)] = cur;
+				}
+			}
+			free(shard->buckets);
+			shard->buckets = buckets;
+			shard->nbuckets = nbuckets;
+		}
 	}
-*/
-	const char *kp;
-	if ((kp = ast_variable_retrieve(cfg, "general", "keyprefix"))) {
-		strcat(mcd_config, "--NAMESPACE=");
-		strcat(mcd_config, kp);
-		strcat(mcd_config, " ");
+
+	struct mcd_item **bucket = &shard->buckets[(it->hash >> 3) & (shard->nbuckets - 1)];
+	it->hnext = *bucket;
+	*bucket = it;
+	mcd_lru_push(&shard->classes[it->cls], it);
+	shard->nitems++;
+
+}
+
+static struct mcd_item *mcd_item_find(struct mcd_store_shard *shard, 
+	const char *key, size_t nkey, uint32_t hash, time_t now
+) {
+	struct mcd_item *it;
+	for (it = shard->buckets[(hash >> 3) & (shard->nbuckets - 1)]; it; it = it->hnext)
+		if ((it->hash == hash) && (it->nkey == nkey) && (memcmp(it->data, key, nkey) == 0))
+			break;
+	if (it && it->exptime && (it->exptime <= now)) {
+		mcd_item_unlink(shard, it);
+		shard->expired++;
+		return NULL;
 	}
+	return it;
+}
 
-    // launch memcached client (pool of)
-    mcd_config[strlen(mcd_config) - 1] = 0;
-    if ((mcdpool = memcached_pool(mcd_config, strlen(mcd_config))))
-	    ast_log(LOG_DEBUG, "res_memcached starting with config: '%s'\n", mcd_config);
-	else
-	    ast_log(LOG_ERROR, "res_memcached failed to start with config: '%s'\n", mcd_config);
+static void mcd_slab_page_carve(struct mcd_store_shard *shard, unsigned int page, int cls) {
+	struct mcd_slab_class *class = &shard->classes[cls];
+	size_t offset;
+	for (offset = 0; offset + class->size <= STORE_PAGE_SIZE; offset += class->size) {
+		struct mcd_item *it = (struct mcd_item *)(shard->pages[page] + offset);
+		it->cls = cls;
+		mcd_chunk_free(class, it);
+	}
+	shard->page_cls[page] = cls;
+	class->pages++;
+}
 
-	ast_config_destroy(cfg);
+static int mcd_slab_page_reassign(struct mcd_store_shard *shard, int cls) {
+// evicts all the items on one page of the class holding the most pages, and hands the page over
+
+	int victim = -1, i;
+	for (i = 0; i < shard->nclasses; i++)
+		if ((i != cls) && shard->classes[i].pages && 
+			((victim < 0) || (shard->classes[i].pages > shard->classes[victim].pages))
+		)
+			victim = i;
+	if (victim < 0)
+		return -1;
+	unsigned int page = shard->npages;
+	while (page-- > 0)
+		if (shard->page_cls[page] == victim)
+			break;
+
+	struct mcd_slab_class *class = &shard->classes[victim];
+	size_t offset;
+	for (offset = 0; offset + class->size <= STORE_PAGE_SIZE; offset += class->size) {
+		struct mcd_item *it = (struct mcd_item *)(shard->pages[page] + offset);
+		if (it->used) {
+			mcd_item_unlink(shard, it);
+			shard->evictions++;
+		}
+		mcd_chunk_list_remove(&class->free, NULL, it);
+	}
+	class->pages--;
+	mcd_slab_page_carve(shard, page, cls);
+	shard->reassigned++;
 	return 0;
 
 }
 
-static int mcd_read(struct ast_channel *chan, 
-	const char *cmd, char *parse, char *buffer, size_t buflen
+static struct mcd_item *mcd_item_alloc(struct mcd_store_shard *shard, 
+	size_t nkey, size_t nvalue, time_t now, memcached_return_t *ret
 ) {
-// asterisk dialplan function that returns the contents of a memcached key
 
-	memcached_return_t rc;
-	memcached_st *mcd = memcached_pool_fetch(mcdpool, &to, &rc);
-	if (rc) {
-        ast_log(LOG_WARNING, "mcd_read: memcached pool error: %d\n", rc);
-		return 0;
-    }
+	size_t total = sizeof(struct mcd_item) + nkey + nvalue + 1;
+	int cls;
+	for (cls = 0; cls < shard->nclasses; cls++)
+		if (shard->classes[cls].size >= total)
+			break;
+	if (cls == shard->nclasses) {
+		*ret = MEMCACHED_E2BIG;
+		return NULL;
+	}
 
-	char *key = (char *)ast_malloc(MEMCACHED_MAX_KEY);
-	buffer[0] = 0;
+	struct mcd_slab_class *class = &shard->classes[cls];
+	if (!class->free) {
+		struct mcd_item *tail = class->lru_tail;
+		if (tail && tail->exptime && (tail->exptime <= now)) {
+			mcd_item_unlink(shard, tail);
+			shard->expired++;
+		} else if ((shard->npages < shard->maxpages) && (shard->pages[shard->npages] = ast_malloc(STORE_PAGE_SIZE))) {
+			mcd_slab_page_carve(shard, shard->npages++, cls);
+		} else if (tail) {
+			mcd_item_unlink(shard, tail);
+			shard->evictions++;
+		} else if (mcd_slab_page_reassign(shard, cls)) {
+			*ret = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+			return NULL;
+		}
+	}
 
-	if (ast_strlen_zero(parse)) {
-		ast_log(LOG_WARNING, "MCD requires argument (key)\n");
-		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
-		free(key);
+	struct mcd_item *it = class->free;
+	mcd_chunk_list_remove(&class->free, NULL, it);
+	it->used = 1;
+	it->cls = cls;
+	it->nkey = nkey;
+	it->nvalue = nvalue;
+	return it;
+
+}
+
+static time_t mcd_store_exptime(time_t ttl, time_t now) {
+	if (ttl == 0)
 		return 0;
-	}
-	strcpy(key, parse);
+	return (ttl > STORE_RELATIVE_TTL_MAX) ? ttl : now + ttl;
+}
 
-	memcached_return_t mcdret; size_t szmcdval; uint32_t mcdflags;
-	char *mcdval = memcached_get(mcd, key, strlen(key), &szmcdval, &mcdflags, &mcdret);
-	if (mcdret)
-		ast_log(LOG_WARNING, 
-			"MCD() error %d: %s\n", mcdret, memcached_strerror(mcd, mcdret)
-		);
-	mcd_set_operation_result(chan, mcdret);
-	if (mcdret == MEMCACHED_SUCCESS) {
-		if (szmcdval > MAX_ASTERISK_VARLEN) {
-			ast_log(LOG_WARNING, 
-				"returned value (%d bytes) longer that what an asterisk variable can accomodate (%d bytes)\n",
-				(int)szmcdval, MAX_ASTERISK_VARLEN
-			);
-			mcd_set_operation_result(chan, MEMCACHED_VALUE_TOO_LONG);
-		} else
-			ast_copy_string(buffer, mcdval, buflen);
+static memcached_return_t mcd_store_put(struct mcd_store_shard *shard, const char *key, size_t nkey, 
+	uint32_t hash, const char *prefix, size_t nprefix, const char *value, size_t len, 
+	time_t exptime, uint32_t flags, time_t now
+) {
+// stores prefix + value at key, replacing the item already there; shard lock held
+
+	memcached_return_t ret = MEMCACHED_SUCCESS;
+	struct mcd_item *it = mcd_item_alloc(shard, nkey, nprefix + len, now, &ret), *old;
+	if (!it)
+		return ret;
+	it->hash = hash;
+	it->exptime = exptime;
+	it->flags = flags;
+	memcpy(it->data, key, nkey);
+	if (nprefix)
+		memcpy(it->data + nkey, prefix, nprefix);
+	memcpy(it->data + nkey + nprefix, value, len);
+	it->data[nkey + nprefix + len] = 0;
+	// looked up only now: making room may have evicted the old item already
+	if ((old = mcd_item_find(shard, key, nkey, hash, now)))
+		mcd_item_unlink(shard, old);
+	mcd_item_link(shard, it);
+	return MEMCACHED_SUCCESS;
+
+}
+
+static char *mcd_store_get(struct mcd_store *store, const char *key, 
+	size_t *len, uint32_t *flags, memcached_return_t *ret
+) {
+
+	size_t nkey = strlen(key);
+	uint32_t hash = mcd_store_hash(key, nkey);
+	struct mcd_store_shard *shard = &store->shards[hash & (STORE_SHARDS - 1)];
+	char *value = NULL;
+
+	ast_mutex_lock(&shard->lock);
+	struct mcd_item *it = mcd_item_find(shard, key, nkey, hash, time(NULL));
+	if (!it) {
+		shard->misses++;
+		*ret = MEMCACHED_NOTFOUND;
+	} else if (!(value = ast_malloc(it->nvalue + 1))) {
+		*ret = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+	} else {
+		shard->hits++;
+		mcd_item_touch(shard, it);
+		memcpy(value, it->data + it->nkey, it->nvalue + 1);
+		*len = it->nvalue;
+		*flags = it->flags;
+		*ret = MEMCACHED_SUCCESS;
 	}
-	free(key);
-	memcached_pool_release(mcdpool, mcd);
-	return 0;
+	ast_mutex_unlock(&shard->lock);
+	return value;
 
 }
 
-static int mcd_write(
-	struct ast_channel *chan, const char *cmd, char *parse, const char *value
+static memcached_return_t mcd_store_store(struct mcd_store *store, const char *cmd, 
+	const char *key, const char *value, size_t len, time_t ttl, uint32_t flags
 ) {
+// set, add, replace or append, with the memcached semantics
+
+	size_t nkey = strlen(key);
+	uint32_t hash = mcd_store_hash(key, nkey);
+	struct mcd_store_shard *shard = &store->shards[hash & (STORE_SHARDS - 1)];
+	time_t now = time(NULL), exptime = mcd_store_exptime(ttl, now);
+	char *prefix = NULL;
+	size_t nprefix = 0;
+	memcached_return_t ret;
+
+	ast_mutex_lock(&shard->lock);
+	struct mcd_item *old = mcd_item_find(shard, key, nkey, hash, now);
+	if ((old && (strcmp(cmd, "add") == 0)) || (!old && ((strcmp(cmd, "replace") == 0) || (strcmp(cmd, "append") == 0)))) {
+		ast_mutex_unlock(&shard->lock);
+		return MEMCACHED_NOTSTORED;
+	}
+	if (strcmp(cmd, "append") == 0) {
+		// the old value is copied out, the old item may be evicted to make room for the new one
+		nprefix = old->nvalue;
+		if (!(prefix = ast_malloc(nprefix + 1))) {
+			ast_mutex_unlock(&shard->lock);
+			return MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+		}
+		memcpy(prefix, old->data + old->nkey, nprefix);
+		exptime = old->exptime;
+		flags = old->flags;
+	}
+	ret = mcd_store_put(shard, key, nkey, hash, prefix, nprefix, value, len, exptime, flags, now);
+	ast_mutex_unlock(&shard->lock);
+	free(prefix);
+	return ret;
 
-	memcached_return_t rc;
-	memcached_st *mcd = memcached_pool_fetch(mcdpool, &to, &rc);
-	if (rc) {
-        ast_log(LOG_WARNING, "mcd_write: memcached pool error: %d\n", rc);
-		return 0;
-    }
+}
 
-	char *key = (char *)ast_malloc(MEMCACHED_MAX_KEY);
-	unsigned int timeout = mcdttl; 
+static memcached_return_t mcd_store_delete(struct mcd_store *store, const char *key) {
 
-	mcd_set_operation_result(chan, MEMCACHED_SUCCESS);
+	size_t nkey = strlen(key);
+	uint32_t hash = mcd_store_hash(key, nkey);
+	struct mcd_store_shard *shard = &store->shards[hash & (STORE_SHARDS - 1)];
 
-	// the app argument is the key to set
-	if (ast_strlen_zero(parse)) {
-		ast_log(LOG_WARNING, "MCD() requires argument (key)\n");
-		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
-		free(key);
-		return 0;
-	}
-	strcpy(key, parse);
-	ast_log(LOG_DEBUG, "setting value for key: %s=%s\n", key, value);
+	ast_mutex_lock(&shard->lock);
+	struct mcd_item *it = mcd_item_find(shard, key, nkey, hash, time(NULL));
+	if (it)
+		mcd_item_unlink(shard, it);
+	ast_mutex_unlock(&shard->lock);
+	return it ? MEMCACHED_SUCCESS : MEMCACHED_NOTFOUND;
 
-	const char *ttlval = pbx_builtin_getvar_helper(chan, "MCDTTL");
-	if (ttlval) {
-		timeout = atoi(ttlval);
-		if ((timeout == 0) && (strcmp(ttlval, "0") != 0)) {
-			ast_log(LOG_WARNING, "dialplan variable MCDTTL=%s (not numeric), will use time-to-live value in the config file\n", ttlval);
-			timeout = mcdttl;
+}
+
+static memcached_return_t mcd_store_incr(struct mcd_store *store, const char *key, 
+	int64_t delta, const uint64_t *initial, time_t ttl, uint64_t *value
+) {
+// increments (or decrements, never below 0) a decimal value; a missing key is created with the 
+// initial value when there is one
+
+	size_t nkey = strlen(key);
+	uint32_t hash = mcd_store_hash(key, nkey);
+	struct mcd_store_shard *shard = &store->shards[hash & (STORE_SHARDS - 1)];
+	time_t now = time(NULL), exptime = mcd_store_exptime(ttl, now);
+	uint32_t flags = 0;
+	uint64_t newval;
+
+	ast_mutex_lock(&shard->lock);
+	struct mcd_item *old = mcd_item_find(shard, key, nkey, hash, now);
+	if (!old) {
+		if (!initial) {
+			ast_mutex_unlock(&shard->lock);
+			return MEMCACHED_NOTFOUND;
 		}
+		newval = *initial;
+	} else {
+		const char *digits = old->data + old->nkey;
+		char *end;
+		if ((old->nvalue == 0) || (old->nvalue > 20) || !isdigit((unsigned char)digits[0])) {
+			ast_mutex_unlock(&shard->lock);
+			return MEMCACHED_CLIENT_ERROR;
+		}
+		uint64_t current = strtoull(digits, &end, 10);
+		if (end != digits + old->nvalue) {
+			ast_mutex_unlock(&shard->lock);
+			return MEMCACHED_CLIENT_ERROR;
+		}
+		if (delta >= 0)
+			newval = current + (uint64_t)delta;
+		else
+			newval = (current < (uint64_t)-delta) ? 0 : current - (uint64_t)-delta;
+		exptime = old->exptime;
+		flags = old->flags;
 	}
-	ast_log(LOG_DEBUG, "timeout: %d\n", timeout);
+	char buf[24];
+	int len = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)newval);
+	memcached_return_t ret = mcd_store_put(shard, key, nkey, hash, NULL, 0, buf, len, exptime, flags, now);
+	ast_mutex_unlock(&shard->lock);
+	if (ret == MEMCACHED_SUCCESS)
+		*value = newval;
+	return ret;
 
-	memcached_return_t mcdret = MEMCACHED_FAILURE;
-	mcdret = memcached_set(mcd, 
-		key, strlen(key), value, strlen(value), (time_t)timeout, (uint32_t)0
-	);
-	if (mcdret)
-		ast_log(LOG_WARNING, 
-			"memcached_%s() error %d: %s\n", cmd, mcdret, memcached_strerror(mcd, mcdret)
-		);
+}
 
-	mcd_set_operation_result(chan, mcdret);
-	free(key);
-	memcached_pool_release(mcdpool, mcd);
-	return 0;
+static int mcd_fetch_wait(struct mcd_cluster *cluster, memcached_st **mcd, struct timespec *wait) {
+// fetches a connection from the pool of a cluster, waiting for one at most this long; *mcd is 
+// left NULL (with a success) when the operations are to be done in the embedded store instead 
+// (the cluster has no servers, or they cannot be reached), and the mcd_op_*() below take care 
+// of that. a connection has to be given back with mcd_release()
+
+	memcached_return_t rc = MEMCACHED_NO_SERVERS;
+	*mcd = cluster->pool ? memcached_pool_fetch(cluster->pool, wait, &rc) : NULL;
+	if (*mcd)
+		return MEMCACHED_SUCCESS;
+	// a pool with all its connections busy is no reason to fall back: the servers have the data
+	if (cluster->store && (!cluster->pool || MCD_UNREACHABLE(rc)))
+		return MEMCACHED_SUCCESS;
+	return rc ? rc : MEMCACHED_FAILURE;
 
 }
 
-static int mcdget_exec(struct ast_channel *chan, const char *data) {
+static int mcd_fetch(struct mcd_cluster *cluster, memcached_st **mcd) {
+// the same, for the calls: they only wait for a connection briefly
+	int rc = mcd_fetch_wait(cluster, mcd, &to);
+	if (rc)
+		ast_log(LOG_WARNING, "memcached pool error for cluster %s: %d\n", cluster->name, rc);
+	return rc;
+}
 
-	memcached_return_t rc;
-	memcached_st *mcd = memcached_pool_fetch(mcdpool, &to, &rc);
-	if (rc) {
-        ast_log(LOG_WARNING, "mcdget_exec: memcached pool error: %d\n", rc);
-		return 0;
-    }
+static void mcd_release(struct mcd_cluster *cluster, memcached_st *mcd) {
+	if (mcd)
+		memcached_pool_release(cluster->pool, mcd);
+}
 
-	char *argcopy;
-	char *key = (char *)ast_malloc(MEMCACHED_MAX_KEY);
+// the server operations: done with the connection when there is one, in the embedded store when 
+// there is none, or when the server of the key cannot be reached and the cluster falls back to 
+// the store
 
-	mcd_set_operation_result(chan, MEMCACHED_SUCCESS);
+static char *mcd_op_get(struct mcd_cluster *cluster, memcached_st *mcd, const char *key, 
+	size_t *len, uint32_t *flags, memcached_return_t *ret
+) {
+	if (mcd) {
+		char *value = memcached_get(mcd, key, strlen(key), len, flags, ret);
+		if (!cluster->store || !MCD_UNREACHABLE(*ret))
+			return value;
+		free(value);
+	}
+	return mcd_store_get(cluster->store, key, len, flags, ret);
+}
 
-	// parse the app arguments
-	AST_DECLARE_APP_ARGS(args,
-		AST_APP_ARG(varname);
+static memcached_return_t mcd_op_store(struct mcd_cluster *cluster, memcached_st *mcd, const char *cmd, 
+	const char *key, const char *value, size_t len, time_t ttl, uint32_t flags
+) {
+	memcached_return_t ret = MEMCACHED_FAILURE;
+	if (mcd) {
+		if (strcmp(cmd, "set") == 0)
+			ret = memcached_set(mcd, key, strlen(key), value, len, ttl, flags);
+		else if (strcmp(cmd, "add") == 0)
+			ret = memcached_add(mcd, key, strlen(key), value, len, ttl, flags);
+		else if (strcmp(cmd, "replace") == 0)
+			ret = memcached_replace(mcd, key, strlen(key), value, len, ttl, flags);
+		else if (strcmp(cmd, "append") == 0)
+			ret = memcached_append(mcd, key, strlen(key), value, len, ttl, flags);
+		if (!cluster->store || !MCD_UNREACHABLE(ret))
+			return ret;
+	}
+	return mcd_store_store(cluster->store, cmd, key, value, len, ttl, flags);
+}
+
+static memcached_return_t mcd_op_delete(struct mcd_cluster *cluster, memcached_st *mcd, const char *key) {
+	if (mcd) {
+		memcached_return_t ret = memcached_delete(mcd, key, strlen(key), (time_t)0);
+		if (!cluster->store || !MCD_UNREACHABLE(ret))
+			return ret;
+	}
+	return mcd_store_delete(cluster->store, key);
+}
+
+static memcached_return_t mcd_op_incr(struct mcd_cluster *cluster, memcached_st *mcd, const char *key, 
+	int64_t delta, const uint64_t *initial, time_t ttl, uint64_t *value
+) {
+// with an initial value, delta may not be negative
+	if (mcd) {
+		memcached_return_t ret;
+		if (initial)
+			ret = memcached_increment_with_initial(mcd, key, strlen(key), (uint64_t)delta, *initial, ttl, value);
+		else if (delta >= 0)
+			ret = memcached_increment(mcd, key, strlen(key), (uint32_t)delta, value);
+		else
+			ret = memcached_decrement(mcd, key, strlen(key), (uint32_t)-delta, value);
+		if (!cluster->store || !MCD_UNREACHABLE(ret))
+			return ret;
+	}
+	return mcd_store_incr(cluster->store, key, delta, initial, ttl, value);
+}
+
+static void mcd_nsgen_cache_store(struct mcd_cluster *cluster, const char *ns, uint64_t gen) {
+	struct mcd_nsgen *slot = &nsgen_cache[ast_str_hash(ns) % NSGEN_CACHE_SLOTS];
+	ast_mutex_lock(&nsgen_lock);
+	slot->cluster = cluster;
+	ast_copy_string(slot->ns, ns, sizeof(slot->ns));
+	slot->gen = gen;
+	slot->expires = ast_tvadd(ast_tvnow(), ast_samp2tv(nsgen_cache_ms, 1000));
+	ast_mutex_unlock(&nsgen_lock);
+}
+
+static int mcd_nsgen_lookup(struct mcd_cluster *cluster, memcached_st *mcd, const char *ns, uint64_t *gen) {
+// returns the current generation number of a namespace, from the local cache if still fresh
+
+	struct mcd_nsgen *slot = &nsgen_cache[ast_str_hash(ns) % NSGEN_CACHE_SLOTS];
+	ast_mutex_lock(&nsgen_lock);
+	if ((slot->cluster == cluster) && (strcmp(slot->ns, ns) == 0) && (ast_tvcmp(ast_tvnow(), slot->expires) < 0)) {
+		*gen = slot->gen;
+		ast_mutex_unlock(&nsgen_lock);
+		return MEMCACHED_SUCCESS;
+	}
+	ast_mutex_unlock(&nsgen_lock);
+
+	char genkey[MEMCACHED_MAX_KEY];
+	snprintf(genkey, sizeof(genkey), "%s" NSGEN_KEY_SUFFIX, ns);
+
+	memcached_return_t mcdret; size_t szmcdval; uint32_t mcdflags;
+	char *mcdval = mcd_op_get(cluster, mcd, genkey, &szmcdval, &mcdflags, &mcdret);
+	if (mcdret == MEMCACHED_NOTFOUND) {
+		// first use of the namespace, or its generation key was evicted: start from the current 
+		// time, so that we dont land back on a generation that was used before
+		char initial[24];
+		snprintf(initial, sizeof(initial), "%lu", (unsigned long)time(NULL));
+		mcdret = mcd_op_store(cluster, mcd, "add", genkey, initial, strlen(initial), (time_t)0, (uint32_t)0);
+		if (mcdret == MEMCACHED_SUCCESS) {
+			*gen = strtoull(initial, NULL, 10);
+			mcd_nsgen_cache_store(cluster, ns, *gen);
+			return MEMCACHED_SUCCESS;
+		}
+		// somebody else initialized it in the mean time
+		if (mcdret == MEMCACHED_NOTSTORED)
+			mcdval = mcd_op_get(cluster, mcd, genkey, &szmcdval, &mcdflags, &mcdret);
+	}
+	if (mcdret) {
+		ast_log(LOG_WARNING, 
+			"namespace '%s' generation lookup error %d: %s\n", ns, mcdret, memcached_strerror(mcd, mcdret)
+		);
+		free(mcdval);
+		return mcdret;
+	}
+	*gen = strtoull(mcdval, NULL, 10);
+	free(mcdval);
+	mcd_nsgen_cache_store(cluster, ns, *gen);
+	return MEMCACHED_SUCCESS;
+
+}
+
+static int mcd_resolve_key(struct mcd_cluster *cluster, memcached_st *mcd, const char *rawkey, char *key) {
+// copies the key given in the dialplan into a buffer of MEMCACHED_MAX_KEY bytes; when namespaces 
+// are enabled, a key in the form ns:key has the current generation of the namespace inserted
+
+	if (use_namespaces) {
+		const char *sep = strchr(rawkey, ':');
+		if (sep && (sep != rawkey) && (sep - rawkey < MEMCACHED_MAX_KEY)) {
+			char ns[MEMCACHED_MAX_KEY];
+			ast_copy_string(ns, rawkey, sep - rawkey + 1);
+			uint64_t gen;
+			int mcdret = mcd_nsgen_lookup(cluster, mcd, ns, &gen);
+			if (mcdret)
+				return mcdret;
+			if (snprintf(key, MEMCACHED_MAX_KEY, "%s:%llu%s", ns, (unsigned long long)gen, sep) >= MEMCACHED_MAX_KEY) {
+				ast_log(LOG_WARNING, "key too long: %s\n", rawkey);
+				return MEMCACHED_KEY_TOO_LONG;
+			}
+			ast_debug(1, "namespaced key %s resolved to %s\n", rawkey, key);
+			return MEMCACHED_SUCCESS;
+		}
+	}
+	if (strlen(rawkey) >= MEMCACHED_MAX_KEY) {
+		ast_log(LOG_WARNING, "key too long: %s\n", rawkey);
+		return MEMCACHED_KEY_TOO_LONG;
+	}
+	strcpy(key, rawkey);
+	return MEMCACHED_SUCCESS;
+
+}
+
+static struct mcd_cluster *mcd_cluster_find(const char *name) {
+	struct mcd_cluster *cluster;
+	AST_LIST_TRAVERSE(&mcd_clusters, cluster, list)
+		if (strcasecmp(cluster->name, name) == 0)
+			return cluster;
+	return NULL;
+}
+
+static int mcd_cluster_for_key(struct ast_channel *chan, const char *rawkey, 
+	struct mcd_cluster **cluster, char *plainkey
+) {
+// picks the cluster for a key given in the dialplan, and copies the key without its @cluster 
+// suffix (if any) into a buffer of MEMCACHED_MAX_KEY bytes
+
+	if (strlen(rawkey) >= MEMCACHED_MAX_KEY) {
+		ast_log(LOG_WARNING, "key too long: %s\n", rawkey);
+		return MEMCACHED_KEY_TOO_LONG;
+	}
+	strcpy(plainkey, rawkey);
+	// no cluster at all when the config file could not be loaded
+	if (!(*cluster = default_cluster)) {
+		ast_log(LOG_WARNING, "no memcached cluster configured, check " CONFIG_FILE_NAME "\n");
+		return MEMCACHED_NO_SERVERS;
+	}
+	if (cluster_count < 2)
+		return MEMCACHED_SUCCESS;
+
+	// a suffix that is not the name of a cluster is just part of the key
+	char *at = strrchr(plainkey, '@');
+	if (at && (at != plainkey) && (*cluster = mcd_cluster_find(at + 1))) {
+		*at = 0;
+		return MEMCACHED_SUCCESS;
+	}
+
+	const char *name = chan ? pbx_builtin_getvar_helper(chan, "MCDCLUSTER") : NULL;
+	if (!ast_strlen_zero(name)) {
+		if ((*cluster = mcd_cluster_find(name)))
+			return MEMCACHED_SUCCESS;
+		ast_log(LOG_WARNING, "dialplan variable MCDCLUSTER=%s is not a configured cluster, ignoring it\n", name);
+	}
+
+	struct mcd_route *route, *best = NULL;
+	AST_LIST_TRAVERSE(&mcd_routes, route, list)
+		if ((strncmp(plainkey, route->prefix, route->len) == 0) && (!best || (route->len > best->len)))
+			best = route;
+	*cluster = best ? best->cluster : default_cluster;
+	return MEMCACHED_SUCCESS;
+
+}
+
+static int mcd_key_fetch(struct ast_channel *chan, const char *rawkey, 
+	struct mcd_cluster **cluster, memcached_st **mcd, char *key
+) {
+// picks the cluster for a key, fetches a connection from the cluster pool (see mcd_fetch()) and 
+// resolves the key (into a buffer of MEMCACHED_MAX_KEY bytes); on success, the connection has to 
+// be given back with mcd_release(*cluster, *mcd)
+
+	char plainkey[MEMCACHED_MAX_KEY];
+	int keyret = mcd_cluster_for_key(chan, rawkey, cluster, plainkey);
+	if (keyret)
+		return keyret;
+
+	if ((keyret = mcd_fetch(*cluster, mcd)))
+		return keyret;
+	if ((keyret = mcd_resolve_key(*cluster, *mcd, plainkey, key))) {
+		mcd_release(*cluster, *mcd);
+		*mcd = NULL;
+	}
+	return keyret;
+
+}
+
+static void mcd_hotkeys_update(struct mcd_hotkeys *summary, const char *key, size_t size) {
+// space-saving: a key not in the summary takes over the slot with the lowest count, inheriting 
+// that count as its error margin; must be called with hotkeys_lock held
+
+	struct mcd_hotkey *slot = NULL, *min = NULL;
+	int i;
+	for (i = 0; i < summary->used; i++) {
+		if (strcmp(summary->slots[i].key, key) == 0) {
+			slot = &summary->slots[i];
+			break;
+		}
+		if (!min || (summary->slots[i].count < min->count))
+			min = &summary->slots[i];
+	}
+	if (!slot) {
+		if (summary->used < HOTKEY_SLOTS) {
+			slot = &summary->slots[summary->used++];
+			memset(slot, 0, sizeof(*slot));
+		} else {
+			slot = min;
+			slot->error = slot->count;
+			slot->samples = 0;
+			slot->bytes = 0;
+			slot->maxbytes = 0;
+		}
+		ast_copy_string(slot->key, key, sizeof(slot->key));
+	}
+	slot->count++;
+	slot->samples++;
+	slot->bytes += size;
+	if (size > slot->maxbytes)
+		slot->maxbytes = size;
+
+}
+
+static void mcd_hotkey_track(const char *key, size_t size) {
+// called for every key operation, with the size of the value read or written
+
+	if (!hotkey_sample || ((unsigned int)ast_atomic_fetchadd_int(&hotkey_ticks, 1) % hotkey_sample))
+		return;
+
+	char prefix[MEMCACHED_MAX_KEY];
+	size_t len = 0;
+	while (key[len] && isalnum((unsigned char)key[len]) && (len < sizeof(prefix) - 1))
+		len++;
+	memcpy(prefix, key, len);
+	prefix[len] = 0;
+
+	ast_mutex_lock(&hotkeys_lock);
+	hotkey_sampled++;
+	mcd_hotkeys_update(&hotkeys, key, size);
+	mcd_hotkeys_update(&hotprefixes, prefix, size);
+	ast_mutex_unlock(&hotkeys_lock);
+
+}
+
+static void mcd_trace_destroy(void *data) {
+	free(data);
+	ast_atomic_fetchadd_int(&trace_channels, -1);
+}
+
+static const struct ast_datastore_info mcd_trace_info = {
+	.type = "MCDTRACE",
+	.destroy = mcd_trace_destroy,
+};
+
+static void mcd_server_name(memcached_st *mcd, const char *key, char *name, size_t namelen) {
+// the host:port of the server a key is hashed to
+
+	if (!mcd) {
+		ast_copy_string(name, "(embedded)", namelen);
+		return;
+	}
+	memcached_return_t rc;
+	memcached_server_instance_st server = memcached_server_by_key(mcd, key, strlen(key), &rc);
+	if (server)
+		snprintf(name, namelen, "%s:%d", memcached_server_name(server), (int)memcached_server_port(server));
+	else
+		ast_copy_string(name, "(none)", namelen);
+
+}
+
+static void mcd_op_done(struct ast_channel *chan, struct mcd_cluster *cluster, memcached_st *mcd, 
+	const char *op, const char *rawkey, const char *key, size_t size, int mcdret, struct timeval start
+) {
+// called after every server operation: feeds the hot keys summary, the per-server figures, the 
+// slow operations log, and the tracing of the channel (chan may be NULL for operations that dont 
+// belong to a call)
+
+	mcd_hotkey_track(rawkey, size);
+
+	int failed = mcdret && (mcdret != MEMCACHED_NOTFOUND) && (mcdret != MEMCACHED_NOTSTORED) && (mcdret != MEMCACHED_DATA_EXISTS);
+	if (mcd && cluster->server_stats && 
+		(failed || !((unsigned int)ast_atomic_fetchadd_int(&cluster->stats_ticks, 1) % SERVER_STATS_SAMPLE))
+	) {
+		uint32_t position = memcached_generate_hash(mcd, key, strlen(key));
+		if (position < cluster->nservers) {
+			struct mcd_server_stats *stats = &cluster->server_stats[position];
+			ast_mutex_lock(&cluster->stats_lock);
+			if (failed)
+				stats->errors++;
+			else {
+				int64_t us = ast_tvdiff_us(ast_tvnow(), start);
+				stats->samples++;
+				stats->rtt_us = stats->rtt_us ? stats->rtt_us + (us - stats->rtt_us) / 8 : us;
+				if (us > stats->max_us)
+					stats->max_us = us;
+			}
+			ast_mutex_unlock(&cluster->stats_lock);
+		}
+	}
+	if (!slow_threshold && !trace_channels)
+		return;
+
+	int64_t us = ast_tvdiff_us(ast_tvnow(), start);
+	char server[256];
+	server[0] = 0;
+
+	if (trace_channels && chan) {
+		struct ast_datastore *datastore;
+		struct mcd_trace *trace = NULL;
+		ast_channel_lock(chan);
+		if ((datastore = ast_channel_datastore_find(chan, &mcd_trace_info, NULL))) {
+			trace = datastore->data;
+			trace->ops++;
+			trace->total_us += us;
+			if (us > trace->max_us)
+				trace->max_us = us;
+		}
+		ast_channel_unlock(chan);
+		if (trace) {
+			mcd_server_name(mcd, key, server, sizeof(server));
+			ast_log(LOG_NOTICE, "MCDTRACE %s: %s %s on %s, %lld us, %zu bytes, result %d\n", 
+				ast_channel_name(chan), op, key, server, (long long)us, size, mcdret
+			);
+		}
+	}
+
+	if (!slow_threshold || (us < (int64_t)slow_threshold * 1000))
+		return;
+	unsigned int suppressed = 0;
+	ast_mutex_lock(&slow_log_lock);
+	time_t now = time(NULL);
+	if (now != slow_log_second) {
+		suppressed = slow_suppressed;
+		slow_log_second = now;
+		slow_logged = slow_suppressed = 0;
+	}
+	if (slow_log_rate && (slow_logged >= slow_log_rate)) {
+		slow_suppressed++;
+		ast_mutex_unlock(&slow_log_lock);
+		return;
+	}
+	slow_logged++;
+	ast_mutex_unlock(&slow_log_lock);
+
+	if (suppressed)
+		ast_log(LOG_WARNING, "%u more slow memcached operations were not logged\n", suppressed);
+	if (!server[0])
+		mcd_server_name(mcd, key, server, sizeof(server));
+	ast_log(LOG_WARNING, "slow memcached operation: %s %s on %s, %lld ms, %zu bytes, result %d, channel %s\n", 
+		op, key, server, (long long)(us / 1000), size, mcdret, chan ? ast_channel_name(chan) : "(none)"
+	);
+
+}
+
+static int mcd_hotkey_cmp(const void *a, const void *b) {
+	const struct mcd_hotkey *ka = a, *kb = b;
+	return (ka->count < kb->count) - (ka->count > kb->count);
+}
+
+static void mcd_hotkeys_show(int fd, const char *title, struct mcd_hotkeys *summary, int top, unsigned long sampled) {
+// prints a copy of the summary, sorted by count; must be called with hotkeys_lock held
+
+	struct mcd_hotkey sorted[HOTKEY_SLOTS];
+	int i, n = summary->used;
+	memcpy(sorted, summary->slots, n * sizeof(sorted[0]));
+	qsort(sorted, n, sizeof(sorted[0]), mcd_hotkey_cmp);
+
+	ast_cli(fd, "\n%-40s %12s %10s %7s %10s %10s\n", title, "est. ops", "+/-", "share", "avg size", "max size");
+	for (i = 0; (i < n) && (i < top); i++)
+		ast_cli(fd, "%-40.40s %12lu %10lu %6.1f%% %10llu %10zu\n", 
+			sorted[i].key, 
+			sorted[i].count * hotkey_sample, 
+			sorted[i].error * hotkey_sample,
+			sampled ? 100.0 * sorted[i].count / sampled : 0.0,
+			sorted[i].samples ? sorted[i].bytes / sorted[i].samples : 0,
+			sorted[i].maxbytes
+		);
+
+}
+
+static char *handle_cli_mcd_show_hotkeys(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "memcached show hotkeys";
+		e->usage =
+			"Usage: memcached show hotkeys [count]\n"
+			"       Shows the most accessed keys and key prefixes (20 by default), estimated\n"
+			"       from a sample of one in hotkey_sample operations, with their value sizes.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if ((a->argc != 3) && (a->argc != 4))
+		return CLI_SHOWUSAGE;
+	int top = 20;
+	if ((a->argc == 4) && ((top = atoi(a->argv[3])) <= 0))
+		return CLI_SHOWUSAGE;
+
+	if (!hotkey_sample) {
+		ast_cli(a->fd, "hot key sampling is off (hotkey_sample=0 in " CONFIG_FILE_NAME ")\n");
+		return CLI_SUCCESS;
+	}
+
+	ast_mutex_lock(&hotkeys_lock);
+	ast_cli(a->fd, "%lu operations sampled, one in %u\n", hotkey_sampled, hotkey_sample);
+	mcd_hotkeys_show(a->fd, "key", &hotkeys, top, hotkey_sampled);
+	mcd_hotkeys_show(a->fd, "key prefix", &hotprefixes, top, hotkey_sampled);
+	ast_mutex_unlock(&hotkeys_lock);
+	return CLI_SUCCESS;
+
+}
+
+static char *handle_cli_mcd_reset_hotkeys(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "memcached reset hotkeys";
+		e->usage =
+			"Usage: memcached reset hotkeys\n"
+			"       Clears the hot keys summary, to start a new observation period.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3)
+		return CLI_SHOWUSAGE;
+
+	ast_mutex_lock(&hotkeys_lock);
+	hotkeys.used = 0;
+	hotprefixes.used = 0;
+	hotkey_sampled = 0;
+	ast_mutex_unlock(&hotkeys_lock);
+	ast_cli(a->fd, "hot keys summary cleared\n");
+	return CLI_SUCCESS;
+
+}
+
+static void mcd_replicate(struct mcd_cluster *cluster, const char *cmd, 
+	const char *key, const char *value, size_t len, time_t ttl
+) {
+// queues a write that succeeded on a cluster, to be copied to its replica; when the queue is full 
+// the write is dropped (and counted), the replica then misses the key or holds an older value
+
+	if (!cluster->replica || (repl_thread == AST_PTHREADT_NULL))
+		return;
+	struct mcd_repl_op *op = ast_malloc(sizeof(*op) + len + 1);
+	if (!op)
+		return;
+	op->cluster = cluster;
+	op->cmd = cmd;
+	op->ttl = ttl;
+	op->queued = ast_tvnow();
+	ast_copy_string(op->key, key, sizeof(op->key));
+	op->len = len;
+	if (len)
+		memcpy(op->value, value, len);
+	op->value[len] = 0;
+
+	ast_mutex_lock(&repl_lock);
+	if (replica_queue && (repl_queue_len >= replica_queue)) {
+		cluster->repl_dropped++;
+		ast_mutex_unlock(&repl_lock);
+		free(op);
+		return;
+	}
+	AST_LIST_INSERT_TAIL(&mcd_repl_queue, op, list);
+	repl_queue_len++;
+	cluster->repl_queued++;
+	ast_cond_signal(&repl_cond);
+	ast_mutex_unlock(&repl_lock);
+
+}
+
+static void mcd_repl_apply(struct mcd_repl_op *op) {
+// performs a queued write on the replica; set, add and replace all end up as a set there, 
+// since the primary already decided the outcome
+
+	struct mcd_cluster *replica = op->cluster->replica;
+	memcached_st *mcd;
+	memcached_return_t mcdret = MEMCACHED_FAILURE;
+	// unlike the calls, the worker can wait for a connection of the replica (whose pool also 
+	// serves the reads), rather than losing the write
+	struct timespec wait = { .tv_sec = REPL_FETCH_WAIT_MS / 1000, .tv_nsec = (REPL_FETCH_WAIT_MS % 1000) * 1000000 };
+	int attempt;
+	for (attempt = 0; (attempt < REPL_FETCH_ATTEMPTS) && !repl_stop; attempt++)
+		if ((mcdret = mcd_fetch_wait(replica, &mcd, &wait)) == MEMCACHED_SUCCESS)
+			break;
+	if (mcdret == MEMCACHED_SUCCESS) {
+		struct timeval start = ast_tvnow();
+		if (strcmp(op->cmd, "delete") == 0) {
+			mcdret = mcd_op_delete(replica, mcd, op->key);
+			if (mcdret == MEMCACHED_NOTFOUND)
+				mcdret = MEMCACHED_SUCCESS;
+		} else if (strcmp(op->cmd, "append") == 0) {
+			mcdret = mcd_op_store(replica, mcd, "append", op->key, op->value, op->len, op->ttl, (uint32_t)0);
+			// the replica does not have the start of the value: better no value than half of it
+			if (mcdret == MEMCACHED_NOTSTORED)
+				mcd_op_delete(replica, mcd, op->key);
+		} else
+			mcdret = mcd_op_store(replica, mcd, "set", op->key, op->value, op->len, op->ttl, (uint32_t)0);
+		mcd_op_done(NULL, replica, mcd, op->cmd, op->key, op->key, op->len, mcdret, start);
+		mcd_release(replica, mcd);
+	}
+
+	int64_t lag = ast_tvdiff_us(ast_tvnow(), op->queued);
+	ast_mutex_lock(&repl_lock);
+	if (mcdret)
+		op->cluster->repl_failed++;
+	else
+		op->cluster->repl_done++;
+	op->cluster->lag_us = lag;
+	if (lag > op->cluster->max_lag_us)
+		op->cluster->max_lag_us = lag;
+	ast_mutex_unlock(&repl_lock);
+	if (mcdret)
+		ast_debug(1, "replication of %s %s to cluster %s failed, error %d\n", op->cmd, op->key, replica->name, mcdret);
+
+}
+
+static void *mcd_repl_worker(void *data) {
+
+	ast_mutex_lock(&repl_lock);
+	while (!repl_stop) {
+		struct mcd_repl_op *op = AST_LIST_REMOVE_HEAD(&mcd_repl_queue, list);
+		if (!op) {
+			ast_cond_wait(&repl_cond, &repl_lock);
+			continue;
+		}
+		repl_queue_len--;
+		ast_mutex_unlock(&repl_lock);
+		mcd_repl_apply(op);
+		free(op);
+		ast_mutex_lock(&repl_lock);
+	}
+	ast_mutex_unlock(&repl_lock);
+	return NULL;
+
+}
+
+static void mcd_repl_stop(void) {
+	struct mcd_repl_op *op;
+	if (repl_thread != AST_PTHREADT_NULL) {
+		ast_mutex_lock(&repl_lock);
+		repl_stop = 1;
+		ast_cond_signal(&repl_cond);
+		ast_mutex_unlock(&repl_lock);
+		pthread_join(repl_thread, NULL);
+		repl_thread = AST_PTHREADT_NULL;
+	}
+	while ((op = AST_LIST_REMOVE_HEAD(&mcd_repl_queue, list)))
+		free(op);
+	repl_queue_len = 0;
+}
+
+static void mcd_rtt_update(struct mcd_cluster *cluster, struct timeval start, int mcdret) {
+// an error counts as a slow answer, so that reads move away from a failing replica
+	int64_t us = ast_tvdiff_us(ast_tvnow(), start);
+	if (mcdret && (mcdret != MEMCACHED_NOTFOUND))
+		us += (int64_t)to.tv_sec * 1000000 + 100000;
+	ast_mutex_lock(&repl_lock);
+	cluster->reads++;
+	cluster->rtt_us = cluster->rtt_us ? cluster->rtt_us + (us - cluster->rtt_us) / 8 : us;
+	ast_mutex_unlock(&repl_lock);
+}
+
+static char *mcd_get_nearest(struct ast_channel *chan, struct mcd_cluster *cluster, memcached_st *mcd, 
+	const char *rawkey, const char *key, size_t *szmcdval, memcached_return_t *mcdret
+) {
+// gets a key from a cluster, or from its replica; the value returned has to be free()d
+
+	uint32_t mcdflags;
+	struct mcd_cluster *replica = cluster->replica;
+	if (!replica) {
+		struct timeval start = ast_tvnow();
+		char *mcdval = mcd_op_get(cluster, mcd, key, szmcdval, &mcdflags, mcdret);
+		mcd_op_done(chan, cluster, mcd, "get", rawkey, key, *mcdret ? 0 : *szmcdval, *mcdret, start);
+		return mcdval;
+	}
+
+	// pick the one to ask first
+	int replica_first;
+	ast_mutex_lock(&repl_lock);
+	if (cluster->replica_reads == REPLICA_READS_NEAREST) {
+		replica_first = (replica->rtt_us < cluster->rtt_us);
+		if ((cluster->reads % REPLICA_PROBE_EVERY) == 0)
+			replica_first = !replica_first;
+	} else
+		replica_first = (cluster->replica_reads == REPLICA_READS_REPLICA);
+	ast_mutex_unlock(&repl_lock);
+
+	char *mcdval = NULL;
+	int i;
+	for (i = 0; i < 2; i++) {
+		struct mcd_cluster *from = ((i == 0) == replica_first) ? replica : cluster;
+		memcached_st *handle = mcd;
+		if ((from == replica) && (*mcdret = mcd_fetch(replica, &handle)))
+			continue;
+		struct timeval start = ast_tvnow();
+		mcdval = mcd_op_get(from, handle, key, szmcdval, &mcdflags, mcdret);
+		mcd_op_done(chan, from, handle, "get", rawkey, key, *mcdret ? 0 : *szmcdval, *mcdret, start);
+		mcd_rtt_update(from, start, *mcdret);
+		if (from == replica)
+			mcd_release(replica, handle);
+		if (*mcdret == MEMCACHED_SUCCESS)
+			break;
+		free(mcdval);
+		mcdval = NULL;
+		if (i == 0) {
+			ast_mutex_lock(&repl_lock);
+			cluster->read_fallbacks++;
+			ast_mutex_unlock(&repl_lock);
+		}
+	}
+	return mcdval;
+
+}
+
+static char *handle_cli_mcd_show_replicas(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "memcached show replicas";
+		e->usage =
+			"Usage: memcached show replicas\n"
+			"       Shows, for every cluster with a replica, the writes copied to the replica,\n"
+			"       the ones that failed or were dropped, the replication lag, and the read\n"
+			"       latency of both.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3)
+		return CLI_SHOWUSAGE;
+
+	struct mcd_cluster *cluster;
+	int shown = 0;
+	ast_mutex_lock(&repl_lock);
+	AST_LIST_TRAVERSE(&mcd_clusters, cluster, list) {
+		if (!cluster->replica)
+			continue;
+		ast_cli(a->fd, "cluster %s -> replica %s (reads: %s)\n", cluster->name, cluster->replica->name, 
+			(cluster->replica_reads == REPLICA_READS_PRIMARY) ? "primary" : 
+				(cluster->replica_reads == REPLICA_READS_REPLICA) ? "replica" : "nearest"
+		);
+		ast_cli(a->fd, "  writes queued %lu, copied %lu, failed %lu, dropped %lu, pending %lu\n", 
+			cluster->repl_queued, cluster->repl_done, cluster->repl_failed, cluster->repl_dropped, 
+			cluster->repl_queued - cluster->repl_done - cluster->repl_failed
+		);
+		ast_cli(a->fd, "  lag last %lld us, max %lld us\n", 
+			(long long)cluster->lag_us, (long long)cluster->max_lag_us
+		);
+		ast_cli(a->fd, "  reads primary %lu (avg %lld us), replica %lu (avg %lld us), fallbacks %lu\n", 
+			cluster->reads, (long long)cluster->rtt_us, 
+			cluster->replica->reads, (long long)cluster->replica->rtt_us, cluster->read_fallbacks
+		);
+		shown++;
+	}
+	ast_mutex_unlock(&repl_lock);
+	if (!shown)
+		ast_cli(a->fd, "no cluster has a replica= in " CONFIG_FILE_NAME "\n");
+	return CLI_SUCCESS;
+
+}
+
+static char *handle_cli_mcd_show_embedded(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "memcached show embedded";
+		e->usage =
+			"Usage: memcached show embedded\n"
+			"       Shows the memory, items, hit ratio and evictions of the embedded store\n"
+			"       of every cluster that has one.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3)
+		return CLI_SHOWUSAGE;
+
+	struct mcd_cluster *cluster;
+	int shown = 0;
+	AST_LIST_TRAVERSE(&mcd_clusters, cluster, list) {
+		if (!cluster->store)
+			continue;
+		unsigned long items = 0, hits = 0, misses = 0, evictions = 0, expired = 0, reassigned = 0;
+		unsigned long pages = 0, maxpages = 0;
+		int i;
+		for (i = 0; i < STORE_SHARDS; i++) {
+			struct mcd_store_shard *shard = &cluster->store->shards[i];
+			ast_mutex_lock(&shard->lock);
+			items += shard->nitems;
+			hits += shard->hits;
+			misses += shard->misses;
+			evictions += shard->evictions;
+			expired += shard->expired;
+			reassigned += shard->reassigned;
+			pages += shard->npages;
+			maxpages += shard->maxpages;
+			ast_mutex_unlock(&shard->lock);
+		}
+		ast_cli(a->fd, "cluster %s (%s)\n", cluster->name, cluster->pool ? "fallback" : "backend");
+		ast_cli(a->fd, "  memory %lu of %lu KB, %lu items\n", 
+			pages * (STORE_PAGE_SIZE / 1024), maxpages * (STORE_PAGE_SIZE / 1024), items
+		);
+		ast_cli(a->fd, "  hits %lu, misses %lu (%.1f%% hits), evictions %lu, expired %lu, pages moved %lu\n", 
+			hits, misses, (hits + misses) ? 100.0 * hits / (hits + misses) : 0.0, evictions, expired, reassigned
+		);
+		shown++;
+	}
+	if (!shown)
+		ast_cli(a->fd, "no cluster has an embedded store\n");
+	return CLI_SUCCESS;
+
+}
+
+struct mcd_server_report {
+	const char *cluster;
+	unsigned long probes, probe_failures, reconnects;
+	char name[128];
+	int up;
+	memcached_stat_st stat;
+	struct mcd_server_stats client;
+	double eviction_rate;
+};
+
+static int mcd_servers_report(struct mcd_server_report **report) {
+// runs memcached_stat over a connection of every cluster, and puts next to the figures of every 
+// server the ones seen from here; returns the number of servers, the report is to be freed
+
+	struct mcd_server_report *rows = NULL;
+	int count = 0;
+	struct mcd_cluster *cluster;
+	AST_LIST_TRAVERSE(&mcd_clusters, cluster, list) {
+		if (!cluster->pool)
+			continue;
+		memcached_return_t rc;
+		memcached_st *mcd = memcached_pool_fetch(cluster->pool, &to, &rc);
+		if (!mcd) {
+			ast_log(LOG_WARNING, "memcached pool error for cluster %s: %d\n", cluster->name, rc);
+			continue;
+		}
+		uint32_t i, nservers = memcached_server_count(mcd);
+		struct mcd_server_report *more = nservers ? ast_realloc(rows, (count + nservers) * sizeof(*rows)) : NULL;
+		if (!more) {
+			memcached_pool_release(cluster->pool, mcd);
+			continue;
+		}
+		rows = more;
+		// a server that does not answer is left with zeroed statistics
+		memcached_stat_st *stats = memcached_stat(mcd, NULL, &rc);
+		struct timeval now = ast_tvnow();
+		for (i = 0; i < nservers; i++) {
+			struct mcd_server_report *row = &rows[count++];
+			memset(row, 0, sizeof(*row));
+			row->cluster = cluster->name;
+			row->probes = cluster->probes;
+			row->probe_failures = cluster->probe_failures;
+			row->reconnects = cluster->reconnects;
+			memcached_server_instance_st server = memcached_server_instance_by_position(mcd, i);
+			snprintf(row->name, sizeof(row->name), "%s:%d", 
+				memcached_server_name(server), (int)memcached_server_port(server)
+			);
+			if (stats && stats[i].pid) {
+				row->up = 1;
+				row->stat = stats[i];
+			}
+			if (i < cluster->nservers) {
+				struct mcd_server_stats *client = &cluster->server_stats[i];
+				ast_mutex_lock(&cluster->stats_lock);
+				// the evictions per second since the previous report
+				if (row->up) {
+					int64_t ms = ast_tvdiff_ms(now, client->checked);
+					if (!ast_tvzero(client->checked) && (ms > 0) && (row->stat.evictions >= client->evictions))
+						row->eviction_rate = 1000.0 * (row->stat.evictions - client->evictions) / ms;
+					client->evictions = row->stat.evictions;
+					client->checked = now;
+				}
+				row->client = *client;
+				ast_mutex_unlock(&cluster->stats_lock);
+			}
+		}
+		if (stats)
+			memcached_stat_free(NULL, stats);
+		memcached_pool_release(cluster->pool, mcd);
+	}
+	*report = rows;
+	return count;
+
+}
+
+static char *handle_cli_mcd_show_servers(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "memcached show servers";
+		e->usage =
+			"Usage: memcached show servers\n"
+			"       Shows, for every memcached server, its hit ratio, evictions, connections\n"
+			"       and memory, next to the operations, errors and response times seen\n"
+			"       from this asterisk server.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3)
+		return CLI_SHOWUSAGE;
+
+	struct mcd_server_report *report;
+	int i, count = mcd_servers_report(&report);
+	for (i = 0; i < count; i++) {
+		struct mcd_server_report *row = &report[i];
+		memcached_stat_st *stat = &row->stat;
+		if ((i == 0) || (row->cluster != report[i - 1].cluster))
+			ast_cli(a->fd, "cluster %s: %lu keepalive probes, %lu failed, %lu connections reopened\n", 
+				row->cluster, row->probes, row->probe_failures, row->reconnects
+			);
+		if (row->up) {
+			ast_cli(a->fd, "cluster %s, server %s (version %s, up %lu s)\n", 
+				row->cluster, row->name, stat->version, stat->uptime
+			);
+			ast_cli(a->fd, "  gets %llu, hits %llu, misses %llu (%.1f%% hits), items %lu, connections %lu\n", 
+				stat->cmd_get, stat->get_hits, stat->get_misses, 
+				(stat->get_hits + stat->get_misses) ? 100.0 * stat->get_hits / (stat->get_hits + stat->get_misses) : 0.0, 
+				stat->curr_items, stat->curr_connections
+			);
+			ast_cli(a->fd, "  memory %llu of %llu KB (%.1f%% full), evictions %llu (%.1f/s since the last report)\n", 
+				stat->bytes / 1024, stat->limit_maxbytes / 1024, 
+				stat->limit_maxbytes ? 100.0 * stat->bytes / stat->limit_maxbytes : 0.0, 
+				stat->evictions, row->eviction_rate
+			);
+		} else
+			ast_cli(a->fd, "cluster %s, server %s (no answer to stats)\n", row->cluster, row->name);
+		ast_cli(a->fd, "  from here: about %lu operations, %lu errors, response avg %lld us, max %lld us\n", 
+			row->client.samples * SERVER_STATS_SAMPLE, row->client.errors, (long long)row->client.rtt_us, (long long)row->client.max_us
+		);
+	}
+	if (!count)
+		ast_cli(a->fd, "no memcached server to report on\n");
+	free(report);
+	return CLI_SUCCESS;
+
+}
+
+static int manager_mcd_servers(struct mansession *s, const struct message *m) {
+// AMI MemcachedServers: the same report as 'memcached show servers', one event per server
+
+	const char *id = astman_get_header(m, "ActionID");
+	char idtext[256] = "";
+	if (!ast_strlen_zero(id))
+		snprintf(idtext, sizeof(idtext), "ActionID: %s\r\n", id);
+
+	struct mcd_server_report *report;
+	int i, count = mcd_servers_report(&report);
+	astman_send_listack(s, m, "Memcached servers will follow", "start");
+	for (i = 0; i < count; i++) {
+		struct mcd_server_report *row = &report[i];
+		memcached_stat_st *stat = &row->stat;
+		astman_append(s, 
+			"Event: MemcachedServer\r\n"
+			"%s"
+			"Cluster: %s\r\n"
+			"Server: %s\r\n"
+			"Status: %s\r\n"
+			"Version: %s\r\n"
+			"Uptime: %lu\r\n"
+			"Gets: %llu\r\n"
+			"GetHits: %llu\r\n"
+			"GetMisses: %llu\r\n"
+			"Items: %lu\r\n"
+			"Connections: %lu\r\n"
+			"Bytes: %llu\r\n"
+			"LimitMaxBytes: %llu\r\n"
+			"Evictions: %llu\r\n"
+			"EvictionRate: %.1f\r\n"
+			"Operations: %lu\r\n"
+			"Errors: %lu\r\n"
+			"ResponseAvgUs: %lld\r\n"
+			"ResponseMaxUs: %lld\r\n"
+			"ClusterProbes: %lu\r\n"
+			"ClusterProbeFailures: %lu\r\n"
+			"ClusterReconnects: %lu\r\n"
+			"\r\n", 
+			idtext, row->cluster, row->name, row->up ? "up" : "down", stat->version, stat->uptime, 
+			stat->cmd_get, stat->get_hits, stat->get_misses, stat->curr_items, stat->curr_connections, 
+			stat->bytes, stat->limit_maxbytes, stat->evictions, row->eviction_rate, 
+			row->client.samples * SERVER_STATS_SAMPLE, row->client.errors, 
+			(long long)row->client.rtt_us, (long long)row->client.max_us, row->probes, row->probe_failures, row->reconnects
+		);
+	}
+	astman_append(s, 
+		"Event: MemcachedServersComplete\r\n"
+		"EventList: Complete\r\n"
+		"ListItems: %d\r\n"
+		"%s"
+		"\r\n", count, idtext
+	);
+	free(report);
+	return 0;
+
+}
+
+static struct ast_cli_entry cli_memcached[] = {
+	AST_CLI_DEFINE(handle_cli_mcd_show_hotkeys, "Show the most accessed memcached keys"),
+	AST_CLI_DEFINE(handle_cli_mcd_reset_hotkeys, "Clear the memcached hot keys summary"),
+	AST_CLI_DEFINE(handle_cli_mcd_show_replicas, "Show the memcached replication status"),
+	AST_CLI_DEFINE(handle_cli_mcd_show_embedded, "Show the memcached embedded store status"),
+	AST_CLI_DEFINE(handle_cli_mcd_show_servers, "Show the memcached servers statistics"),
+};
+
+static int mcd_pool_probe(struct mcd_cluster *cluster, memcached_st *mcd) {
+// asks every server of a connection for its version, which also opens the connections still 
+// closed; a connection that fails is closed and opened again, here rather than on a call. the 
+// timeouts of the connection are shortened for the probe, so that a dead server does not keep 
+// the connection (and the ones waiting to be probed) out of the pool for long
+
+	uint64_t connect_timeout = memcached_behavior_get(mcd, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT);
+	uint64_t poll_timeout = memcached_behavior_get(mcd, MEMCACHED_BEHAVIOR_POLL_TIMEOUT);
+	memcached_behavior_set(mcd, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, probe_timeout);
+	memcached_behavior_set(mcd, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, probe_timeout);
+
+	memcached_return_t mcdret = memcached_version(mcd);
+	if (mcdret != MEMCACHED_SUCCESS) {
+		memcached_quit(mcd);
+		mcdret = memcached_version(mcd);
+		cluster->reconnects++;
+	}
+	cluster->probes++;
+
+	memcached_behavior_set(mcd, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, connect_timeout);
+	memcached_behavior_set(mcd, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, poll_timeout);
+	return mcdret;
+
+}
+
+static void mcd_pool_warm(struct mcd_cluster *cluster, int startup) {
+// at startup, probes every connection of the pool, which opens all of them to all the servers 
+// before the first call needs them (no call can be waiting for one yet). later on, a round only 
+// probes the connection idle for the longest: the pool hands out the most recently used one 
+// first, so all the idle ones are taken, the ones above the bottom one are given back right away 
+// in their order, and the bottom one goes back on top after its probe; the rounds thus go 
+// through all the connections. a probe needs another connection left idle for the calls in the 
+// mean time: with pool_size=1, or when all the others are busy, the round is skipped
+
+	if (!cluster->pool || !cluster->pool_size)
+		return;
+	memcached_st **handles = ast_calloc(cluster->pool_size, sizeof(*handles));
+	if (!handles)
+		return;
+
+	struct timespec nowait = { 0, 0 };
+	int count = 0, probed = 0, failed = 0, i;
+	memcached_return_t rc;
+	while ((count < (int)cluster->pool_size) && (handles[count] = memcached_pool_fetch(cluster->pool, &nowait, &rc)))
+		count++;
+	if (startup) {
+		for (i = 0; i < count; i++) {
+			if (mcd_pool_probe(cluster, handles[i]) != MEMCACHED_SUCCESS)
+				failed++;
+			memcached_pool_release(cluster->pool, handles[i]);
+		}
+		probed = count;
+	} else if (count) {
+		// handles[0] was on top of the pool, handles[count - 1] at the bottom
+		for (i = count - 2; i >= 0; i--)
+			memcached_pool_release(cluster->pool, handles[i]);
+		if (count > 1) {
+			if (mcd_pool_probe(cluster, handles[count - 1]) != MEMCACHED_SUCCESS)
+				failed++;
+			probed = 1;
+		}
+		memcached_pool_release(cluster->pool, handles[count - 1]);
+	}
+	free(handles);
+	if (!probed)
+		return;
+
+	if (failed) {
+		cluster->probe_failures += failed;
+		if (!cluster->probe_failing || startup)
+			ast_log(LOG_WARNING, "cluster %s: %d of %d connections could not reach all of their servers\n", 
+				cluster->name, failed, probed
+			);
+	} else if (cluster->probe_failing)
+		ast_log(LOG_NOTICE, "cluster %s: all the servers are reachable again\n", cluster->name);
+	else if (startup)
+		ast_debug(1, "cluster %s: %d connections opened\n", cluster->name, probed);
+	cluster->probe_failing = (failed != 0);
+
+}
+
+static void *mcd_keepalive_worker(void *data) {
+
+	ast_mutex_lock(&keepalive_lock);
+	while (!keepalive_stop) {
+		struct timeval wake = ast_tvadd(ast_tvnow(), ast_samp2tv(keepalive, 1));
+		struct timespec ts = { .tv_sec = wake.tv_sec, .tv_nsec = wake.tv_usec * 1000 };
+		while (!keepalive_stop && (ast_cond_timedwait(&keepalive_cond, &keepalive_lock, &ts) != ETIMEDOUT))
+			;
+		if (keepalive_stop)
+			break;
+		ast_mutex_unlock(&keepalive_lock);
+		struct mcd_cluster *cluster;
+		AST_LIST_TRAVERSE(&mcd_clusters, cluster, list)
+			mcd_pool_warm(cluster, 0);
+		ast_mutex_lock(&keepalive_lock);
+	}
+	ast_mutex_unlock(&keepalive_lock);
+	return NULL;
+
+}
+
+static void mcd_keepalive_stop(void) {
+	if (keepalive_thread == AST_PTHREADT_NULL)
+		return;
+	ast_mutex_lock(&keepalive_lock);
+	keepalive_stop = 1;
+	ast_cond_signal(&keepalive_cond);
+	ast_mutex_unlock(&keepalive_lock);
+	pthread_join(keepalive_thread, NULL);
+	keepalive_thread = AST_PTHREADT_NULL;
+}
+
+static uint32_t mcd_hash_tag(const char *key, size_t key_length, void *context) {
+// picks the server of a key from its hash tag only: for "{call123}:legs", "call123" is hashed, so 
+// that all the keys of the same call end up on the same server; keys without a tag are hashed whole
+
+	const char *open = memchr(key, '{', key_length);
+	if (open) {
+		const char *close = memchr(open + 1, '}', key_length - (open + 1 - key));
+		if (close && (close > open + 1)) {
+			key = open + 1;
+			key_length = close - key;
+		}
+	}
+	return libhashkit_digest(key, key_length, HASHKIT_HASH_DEFAULT);
+
+}
+
+static struct mcd_cluster *mcd_cluster_create(struct ast_config *cfg, const char *category) {
+// builds a cluster, and its pool of connections, from a section of the config file
+
+	struct mcd_cluster *cluster = ast_calloc(1, sizeof(*cluster));
+	if (!cluster)
+		return NULL;
+	ast_copy_string(cluster->name, category, sizeof(cluster->name));
+	ast_mutex_init(&cluster->stats_lock);
+
+    // parse server names for memcached from the section
+    char mcd_config[2048]; mcd_config[0] = 0;
+	struct ast_variable *serverentry = ast_variable_browse(cfg, category);
+	for ( ; serverentry; serverentry = serverentry->next) {
+		if (strcasecmp(serverentry->name, "server") == 0) {
+	    	strcat(mcd_config, "--SERVER=");
+    		strcat(mcd_config, serverentry->value);
+    		strcat(mcd_config, " ");
+			cluster->nservers++;
+		} else if (strcasecmp(serverentry->name, "route") == 0) {
+			struct mcd_route *route = ast_calloc(1, sizeof(*route));
+			if (!route)
+				continue;
+			ast_copy_string(route->prefix, serverentry->value, sizeof(route->prefix));
+			route->len = strlen(route->prefix);
+			route->cluster = cluster;
+			AST_LIST_INSERT_TAIL(&mcd_routes, route, list);
+			ast_debug(1, "keys starting with '%s' routed to cluster %s\n", route->prefix, category);
+		} else if (strcasecmp(serverentry->name, "replica") == 0) {
+			ast_copy_string(cluster->replica_name, serverentry->value, sizeof(cluster->replica_name));
+		} else if (strcasecmp(serverentry->name, "replica_reads") == 0) {
+			if (strcasecmp(serverentry->value, "primary") == 0)
+				cluster->replica_reads = REPLICA_READS_PRIMARY;
+			else if (strcasecmp(serverentry->value, "replica") == 0)
+				cluster->replica_reads = REPLICA_READS_REPLICA;
+			else if (strcasecmp(serverentry->value, "nearest") == 0)
+				cluster->replica_reads = REPLICA_READS_NEAREST;
+			else
+				ast_log(LOG_WARNING, "unknown replica_reads=%s in cluster %s, using 'nearest'\n", serverentry->value, category);
+		}
+	}
+    if (strstr(mcd_config, "--SERVER=") == 0) {
+        ast_debug(1, "Expecting memcache server on 127.0.0.1\n");
+        strcpy(mcd_config, "--SERVER=127.0.0.1 ");
+		cluster->nservers = 1;
+    }
+    ast_debug(1, "res_memcached cluster %s configured servers: '%s'\n", category, mcd_config);
+//	strcat(mcd_config, "--SORT-HOSTS ");  not a good idea: turns out that the documentation says:
+//                                        "Enabling this will cause hosts that are added to be placed 
+//                                         in the host list in sorted order. This will defeat 
+//                                         consisten hashing."
+
+	// named clusters default to the time-to-live of [general]
+	cluster->ttl = default_cluster ? default_cluster->ttl : 0;
+	const char *ttlvalue;
+	if ((ttlvalue = ast_variable_retrieve(cfg, category, "ttl")))
+		cluster->ttl = atoi(ttlvalue);
+	ast_debug(1, "default time to live for key-value entries in cluster %s set to %d seconds\n", category, cluster->ttl);
+
+//	if (use_binary_proto)
+//		strcat(mcd_config, "--BINARY-PROTOCOL ");
+//	else
+//		ast_log(LOG_WARNING, "not using memcached binary protocol; MCDCOUNTER() function will be unavailable\n");
+/*
+	const char *hashmode;
+	if ((hashmode = ast_variable_retrieve(cfg, category, "hash"))) {
+		strcat(mcd_config, "--HASH=");
+		strcat(mcd_config, hashmode);
+		strcat(mcd_config, " ");
+	}
+*/
+	const char *kp;
+	if ((kp = ast_variable_retrieve(cfg, category, "keyprefix"))) {
+		strcat(mcd_config, "--NAMESPACE=");
+		strcat(mcd_config, kp);
+		strcat(mcd_config, " ");
+	}
+
+	// all the connections of the pool are created upfront, so that they can all be opened now
+	cluster->pool_size = 1;
+	const char *poolvalue;
+	if ((poolvalue = ast_variable_retrieve(cfg, category, "pool_size")) && (atoi(poolvalue) > 0))
+		cluster->pool_size = atoi(poolvalue);
+	if (keepalive)
+		strcat(mcd_config, "--TCP-KEEPALIVE ");
+
+	// with hash tags, the servers are picked from the {...} part of the keys only
+	cluster->hash_tags = default_cluster ? default_cluster->hash_tags : 0;
+	const char *tagvalue;
+	if ((tagvalue = ast_variable_retrieve(cfg, category, "hash_tags")))
+		cluster->hash_tags = ast_true(tagvalue);
+
+	// the embedded store replaces the servers, or stands in for them when they are unreachable
+	const char *backend = ast_variable_retrieve(cfg, category, "backend");
+	int embedded = backend && (strcasecmp(backend, "embedded") == 0);
+	if (backend && !embedded && (strcasecmp(backend, "memcached") != 0))
+		ast_log(LOG_WARNING, "unknown backend=%s in cluster %s, using memcached\n", backend, category);
+	const char *fallback = ast_variable_retrieve(cfg, category, "embedded_fallback");
+	if (embedded || (fallback && ast_true(fallback))) {
+		size_t memory = 64;
+		const char *memvalue;
+		if ((memvalue = ast_variable_retrieve(cfg, category, "embedded_memory")) && (atoi(memvalue) > 0))
+			memory = atoi(memvalue);
+		if ((cluster->store = mcd_store_create(memory * 1024 * 1024)))
+			ast_debug(1, "cluster %s has an embedded store of %zu MB (%s)\n", 
+				category, memory, embedded ? "backend" : "fallback"
+			);
+		else
+			ast_log(LOG_ERROR, "cluster %s: unable to create the embedded store\n", category);
+	}
+	if (embedded) {
+		cluster->nservers = 0;
+		return cluster;
+	}
+	// one slot per server, in the order of the server= lines, which is their position in the pool
+	if (!(cluster->server_stats = ast_calloc(cluster->nservers, sizeof(*cluster->server_stats))))
+		cluster->nservers = 0;
+
+    // launch memcached client (pool of)
+    if (cluster->hash_tags) {
+		// the pool is made out of a master handle, so that the hash function can be set on it first
+		mcd_config[strlen(mcd_config) - 1] = 0;
+		memcached_st *master = memcached(mcd_config, strlen(mcd_config));
+		hashkit_st *hashkit = hashkit_create(NULL);
+		if (master && hashkit && 
+			(hashkit_set_custom_function(hashkit, mcd_hash_tag, NULL) == HASHKIT_SUCCESS) && 
+			(memcached_set_hashkit(master, hashkit) == MEMCACHED_SUCCESS)
+		)
+			cluster->pool = memcached_pool_create(master, cluster->pool_size, cluster->pool_size);
+		if (hashkit)
+			hashkit_free(hashkit);
+		if (cluster->pool) {
+			ast_debug(1, "res_memcached cluster %s starting with config: '%s', hash tags\n", category, mcd_config);
+			mcd_pool_warm(cluster, 1);
+		} else {
+			if (master)
+				memcached_free(master);
+			ast_log(LOG_ERROR, "res_memcached cluster %s failed to start with config: '%s', hash tags\n", category, mcd_config);
+		}
+		return cluster;
+	}
+	sprintf(mcd_config + strlen(mcd_config), "--POOL-MIN=%u --POOL-MAX=%u ", cluster->pool_size, cluster->pool_size);
+    mcd_config[strlen(mcd_config) - 1] = 0;
+    if ((cluster->pool = memcached_pool(mcd_config, strlen(mcd_config)))) {
+	    ast_debug(1, "res_memcached cluster %s starting with config: '%s'\n", category, mcd_config);
+		mcd_pool_warm(cluster, 1);
+	} else
+	    ast_log(LOG_ERROR, "res_memcached cluster %s failed to start with config: '%s'\n", category, mcd_config);
+
+	return cluster;
+
+}
+
+static int mcd_load_config(void) {
+
+	// initialize the timeout that we wait for a memcached pool operation to complete
+	to.tv_sec = 0; to.tv_nsec = 500000;
+
+	struct ast_config *cfg;
+	struct ast_flags config_flags = { 0 };
+
+	if (!(cfg = ast_config_load(CONFIG_FILE_NAME, config_flags))) {
+		ast_log(LOG_ERROR, "missing memcached resource config file '%s'\n", CONFIG_FILE_NAME);
+		return 1;
+	} else if (cfg == CONFIG_STATUS_FILEINVALID) {
+		ast_log(LOG_ERROR, "memcached resource config file '" CONFIG_FILE_NAME "' invalid format.\n");
+		return 1;
+	}
+
+	use_binary_proto = 1;
+	const char *proto_mode;
+	if ((proto_mode = ast_variable_retrieve(cfg, "general", "binary_proto")))
+		use_binary_proto = ast_true(proto_mode);
+	use_namespaces = 0;
+	const char *nsmode;
+	if ((nsmode = ast_variable_retrieve(cfg, "general", "namespaces")))
+		use_namespaces = ast_true(nsmode);
+	nsgen_cache_ms = 1000;
+	const char *nscache;
+	if ((nscache = ast_variable_retrieve(cfg, "general", "namespace_cache")))
+		nsgen_cache_ms = atoi(nscache);
+	memset(nsgen_cache, 0, sizeof(nsgen_cache));
+	ast_debug(1, "namespaces %s, generation numbers cached for %d ms\n", 
+		use_namespaces ? "enabled" : "disabled", nsgen_cache_ms
+	);
+
+	cache_lease = 10;
+	const char *leasevalue;
+	if ((leasevalue = ast_variable_retrieve(cfg, "general", "cache_lease")))
+		cache_lease = atoi(leasevalue);
+	if (cache_lease == 0)
+		cache_lease = 1;
+
+	sorcery_expire = 300;
+	const char *sorceryvalue;
+	if ((sorceryvalue = ast_variable_retrieve(cfg, "general", "sorcery_expire")))
+		sorcery_expire = atoi(sorceryvalue);
+
+	hotkey_sample = 100;
+	const char *samplevalue;
+	if ((samplevalue = ast_variable_retrieve(cfg, "general", "hotkey_sample")))
+		hotkey_sample = atoi(samplevalue);
+
+	slow_threshold = 100;
+	const char *slowvalue;
+	if ((slowvalue = ast_variable_retrieve(cfg, "general", "slow_threshold")))
+		slow_threshold = atoi(slowvalue);
+	slow_log_rate = 10;
+	if ((slowvalue = ast_variable_retrieve(cfg, "general", "slow_log_rate")))
+		slow_log_rate = atoi(slowvalue);
+
+	keepalive = 30;
+	const char *kavalue;
+	if ((kavalue = ast_variable_retrieve(cfg, "general", "keepalive")))
+		keepalive = atoi(kavalue);
+	probe_timeout = 250;
+	if ((kavalue = ast_variable_retrieve(cfg, "general", "probe_timeout")) && (atoi(kavalue) > 0))
+		probe_timeout = atoi(kavalue);
+
+	// [general] is the default cluster, every other section is a named cluster
+	const char *category = NULL;
+	struct mcd_cluster *cluster;
+	if ((default_cluster = mcd_cluster_create(cfg, DEFAULT_CLUSTER_NAME)))
+		AST_LIST_INSERT_TAIL(&mcd_clusters, default_cluster, list);
+	while ((category = ast_category_browse(cfg, (char *)category))) {
+		if (strcasecmp(category, DEFAULT_CLUSTER_NAME) == 0)
+			continue;
+		if ((cluster = mcd_cluster_create(cfg, category)))
+			AST_LIST_INSERT_TAIL(&mcd_clusters, cluster, list);
+	}
+	cluster_count = 0;
+	int replicas = 0;
+	AST_LIST_TRAVERSE(&mcd_clusters, cluster, list) {
+		cluster_count++;
+		if (ast_strlen_zero(cluster->replica_name))
+			continue;
+		cluster->replica = mcd_cluster_find(cluster->replica_name);
+		if (!cluster->replica || (cluster->replica == cluster)) {
+			ast_log(LOG_WARNING, "cluster %s: replica=%s is not another configured cluster, ignoring it\n", 
+				cluster->name, cluster->replica_name
+			);
+			cluster->replica = NULL;
+			continue;
+		}
+		ast_debug(1, "writes to cluster %s are replicated to cluster %s\n", cluster->name, cluster->replica->name);
+		replicas++;
+	}
+
+	replica_queue = 10000;
+	const char *queuevalue;
+	if ((queuevalue = ast_variable_retrieve(cfg, "general", "replica_queue")))
+		replica_queue = atoi(queuevalue);
+	keepalive_stop = 0;
+	if (keepalive && ast_pthread_create_background(&keepalive_thread, NULL, mcd_keepalive_worker, NULL)) {
+		ast_log(LOG_WARNING, "unable to start the memcached keepalive thread\n");
+		keepalive_thread = AST_PTHREADT_NULL;
+	}
+
+	repl_stop = 0;
+	if (replicas && ast_pthread_create_background(&repl_thread, NULL, mcd_repl_worker, NULL)) {
+		ast_log(LOG_ERROR, "unable to start the memcached replication thread, writes will not be replicated\n");
+		repl_thread = AST_PTHREADT_NULL;
+	}
+
+	ast_config_destroy(cfg);
+	return default_cluster ? 0 : 1;
+
+}
+
+static void mcd_clusters_destroy(void) {
+	struct mcd_route *route;
+	struct mcd_cluster *cluster;
+	default_cluster = NULL;
+	cluster_count = 0;
+	while ((route = AST_LIST_REMOVE_HEAD(&mcd_routes, list)))
+		free(route);
+	while ((cluster = AST_LIST_REMOVE_HEAD(&mcd_clusters, list))) {
+		if (cluster->pool) {
+			// a pool made out of a master handle gives it back, to be freed here
+			memcached_st *master = memcached_pool_destroy(cluster->pool);
+			if (cluster->hash_tags && master)
+				memcached_free(master);
+		}
+		if (cluster->store)
+			mcd_store_destroy(cluster->store);
+		free(cluster->server_stats);
+		ast_mutex_destroy(&cluster->stats_lock);
+		free(cluster);
+	}
+}
+
+static unsigned int mcd_get_ttl(struct ast_channel *chan, struct mcd_cluster *cluster) {
+// the time-to-live for a write: the MCDTTL dialplan variable if set, or else the cluster default
+
+	unsigned int timeout = cluster->ttl;
+	const char *ttlval = pbx_builtin_getvar_helper(chan, "MCDTTL");
+	if (ttlval) {
+		timeout = atoi(ttlval);
+		if ((timeout == 0) && (strcmp(ttlval, "0") != 0)) {
+			ast_log(LOG_WARNING, "dialplan variable MCDTTL=%s (not numeric), will use time-to-live value in the config file\n", ttlval);
+			timeout = cluster->ttl;
+		}
+	}
+	return timeout;
+
+}
+
+static int mcd_read(struct ast_channel *chan, 
+	const char *cmd, char *parse, char *buffer, size_t buflen
+) {
+// asterisk dialplan function that returns the contents of a memcached key
+
+	char *key = (char *)ast_malloc(MEMCACHED_MAX_KEY);
+	buffer[0] = 0;
+
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "MCD requires argument (key)\n");
+		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
+		free(key);
+		return 0;
+	}
+	struct mcd_cluster *cluster;
+	memcached_st *mcd;
+	int keyret = mcd_key_fetch(chan, parse, &cluster, &mcd, key);
+	if (keyret) {
+		mcd_set_operation_result(chan, keyret);
+		free(key);
+		return 0;
+	}
+
+	memcached_return_t mcdret; size_t szmcdval;
+	char *mcdval = mcd_get_nearest(chan, cluster, mcd, parse, key, &szmcdval, &mcdret);
+	if (mcdret)
+		ast_log(LOG_WARNING, 
+			"MCD() error %d: %s\n", mcdret, memcached_strerror(mcd, mcdret)
+		);
+	mcd_set_operation_result(chan, mcdret);
+	if (mcdret == MEMCACHED_SUCCESS) {
+		if (szmcdval > MAX_ASTERISK_VARLEN) {
+			ast_log(LOG_WARNING, 
+				"returned value (%d bytes) longer that what an asterisk variable can accomodate (%d bytes)\n",
+				(int)szmcdval, MAX_ASTERISK_VARLEN
+			);
+			mcd_set_operation_result(chan, MEMCACHED_VALUE_TOO_LONG);
+		} else
+			ast_copy_string(buffer, mcdval, buflen);
+	}
+	free(mcdval);
+	free(key);
+	mcd_release(cluster, mcd);
+	return 0;
+
+}
+
+static int mcd_write(
+	struct ast_channel *chan, const char *cmd, char *parse, const char *value
+) {
+
+	char *key = (char *)ast_malloc(MEMCACHED_MAX_KEY);
+	unsigned int timeout;
+
+	mcd_set_operation_result(chan, MEMCACHED_SUCCESS);
+
+	// the app argument is the key to set
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "MCD() requires argument (key)\n");
+		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
+		free(key);
+		return 0;
+	}
+	struct mcd_cluster *cluster;
+	memcached_st *mcd;
+	int keyret = mcd_key_fetch(chan, parse, &cluster, &mcd, key);
+	if (keyret) {
+		mcd_set_operation_result(chan, keyret);
+		free(key);
+		return 0;
+	}
+	ast_debug(1, "setting value for key: %s=%s\n", key, value);
+
+	timeout = mcd_get_ttl(chan, cluster);
+	ast_debug(1, "timeout: %d\n", timeout);
+
+	memcached_return_t mcdret = MEMCACHED_FAILURE;
+	struct timeval start = ast_tvnow();
+	mcdret = mcd_op_store(cluster, mcd, "set", key, value, strlen(value), (time_t)timeout, (uint32_t)0);
+	if (mcdret)
+		ast_log(LOG_WARNING, 
+			"memcached_%s() error %d: %s\n", cmd, mcdret, memcached_strerror(mcd, mcdret)
+		);
+
+	mcd_set_operation_result(chan, mcdret);
+	mcd_op_done(chan, cluster, mcd, "set", parse, key, strlen(value), mcdret, start);
+	if (mcdret == MEMCACHED_SUCCESS)
+		mcd_replicate(cluster, "set", key, value, strlen(value), (time_t)timeout);
+	free(key);
+	mcd_release(cluster, mcd);
+	return 0;
+
+}
+
+static int mcdget_exec(struct ast_channel *chan, const char *data) {
+
+	char *argcopy;
+	char *key = (char *)ast_malloc(MEMCACHED_MAX_KEY);
+
+	mcd_set_operation_result(chan, MEMCACHED_SUCCESS);
+
+	// parse the app arguments
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(varname);
 		AST_APP_ARG(key);
 	);
 	if (ast_strlen_zero(data)) {
 		ast_log(LOG_WARNING, "app mcdget requires arguments (varname,key)\n");
 		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
 		free(key);
-		memcached_pool_release(mcdpool, mcd);
 		return 0;
 	}
 	argcopy = ast_strdupa(data);
@@ -577,25 +2734,31 @@ static int mcdget_exec(struct ast_channel *chan, const char *data) {
 		ast_log(LOG_WARNING, "key needed\n");
 		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
 		free(key);
-		memcached_pool_release(mcdpool, mcd);
 		return 0;
 	}
-	strcpy(key, args.key);
-	ast_log(LOG_DEBUG, "key: %s\n", key);
+	struct mcd_cluster *cluster;
+	memcached_st *mcd;
+	int keyret = mcd_key_fetch(chan, args.key, &cluster, &mcd, key);
+	if (keyret) {
+		mcd_set_operation_result(chan, keyret);
+		free(key);
+		return 0;
+	}
+	ast_debug(1, "key: %s\n", key);
 
 	if (ast_strlen_zero(args.varname)) {
 		ast_log(LOG_WARNING, "a valid dialplan variable name is needed as first argument\n");
 		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
 		free(key);
-		memcached_pool_release(mcdpool, mcd);
+		mcd_release(cluster, mcd);
 		return 0;
 	}
-	ast_log(LOG_DEBUG, "setting result into variable '%s'\n", args.varname);
+	ast_debug(1, "setting result into variable '%s'\n", args.varname);
 	pbx_builtin_setvar_helper(chan, args.varname, "");
 
 	// get data for key
-	memcached_return_t mcdret; size_t szmcdval; uint32_t mcdflags;
-	char *mcdval = memcached_get(mcd, key, strlen(key), &szmcdval, &mcdflags, &mcdret);
+	memcached_return_t mcdret; size_t szmcdval;
+	char *mcdval = mcd_get_nearest(chan, cluster, mcd, args.key, key, &szmcdval, &mcdret);
 	if (mcdret)
 		ast_log(LOG_WARNING, 
 			"memcached_get() error %d: %s\n", mcdret, memcached_strerror(mcd, mcdret)
@@ -611,23 +2774,17 @@ static int mcdget_exec(struct ast_channel *chan, const char *data) {
 		} else
 			pbx_builtin_setvar_helper(chan, args.varname, mcdval);
 	}
+	free(mcdval);
 	free(key);
-	memcached_pool_release(mcdpool, mcd);
+	mcd_release(cluster, mcd);
 	return 0;
 }
 
 static void mcd_putdata(const char *cmd, struct ast_channel *chan, const char *data) {
 
-	memcached_return_t rc;
-	memcached_st *mcd = memcached_pool_fetch(mcdpool, &to, &rc);
-	if (rc) {
-        ast_log(LOG_WARNING, "mcd_putdata: memcached pool error: %d\n", rc);
-		return;
-    }
-
 	char *argcopy;
 	char *key = (char *)ast_malloc(MEMCACHED_MAX_KEY);
-	unsigned int timeout = mcdttl; 
+	unsigned int timeout;
 
 	// parse the app arguments
 	AST_DECLARE_APP_ARGS(args,
@@ -638,7 +2795,6 @@ static void mcd_putdata(const char *cmd, struct ast_channel *chan, const char *d
 		ast_log(LOG_WARNING, "app mcd%s requires arguments (key,value)\n", cmd);
 		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
 		free(key);
-		memcached_pool_release(mcdpool, mcd);
 		return;
 	}
 	argcopy = ast_strdupa(data);
@@ -648,123 +2804,381 @@ static void mcd_putdata(const char *cmd, struct ast_channel *chan, const char *d
 		ast_log(LOG_WARNING, "key needed\n");
 		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
 		free(key);
-		memcached_pool_release(mcdpool, mcd);
 		return;
 	}
-	strcpy(key, args.key);
-	ast_log(LOG_DEBUG, "key: %s\n", key);
+	struct mcd_cluster *cluster;
+	memcached_st *mcd;
+	int keyret = mcd_key_fetch(chan, args.key, &cluster, &mcd, key);
+	if (keyret) {
+		mcd_set_operation_result(chan, keyret);
+		free(key);
+		return;
+	}
+	ast_debug(1, "key: %s\n", key);
 
 	if (!ast_strlen_zero(args.val))
-		ast_log(LOG_DEBUG, "value: %s\n", args.val);
+		ast_debug(1, "value: %s\n", args.val);
 	else
 		ast_log(LOG_WARNING, "value is set to zero-length\n");
 
-	const char *ttlval = pbx_builtin_getvar_helper(chan, "MCDTTL");
-	if (ttlval) {
-		timeout = atoi(ttlval);
-		if ((timeout == 0) && (strcmp(ttlval, "0") != 0)) {
-			ast_log(LOG_WARNING, "dialplan variable MCDTTL=%s (not numeric), will use time-to-live value in the config file\n", ttlval);
-			timeout = mcdttl;
-		}
+	timeout = mcd_get_ttl(chan, cluster);
+	ast_debug(1, "timeout: %d\n", timeout);
+
+	memcached_return_t mcdret = MEMCACHED_FAILURE;
+	struct timeval start = ast_tvnow();
+	mcdret = mcd_op_store(cluster, mcd, cmd, key, args.val, strlen(args.val), (time_t)timeout, (uint32_t)0);
+
+	if (mcdret)
+		ast_log(LOG_WARNING, 
+			"memcached_%s() error %d: %s\n", cmd, mcdret, memcached_strerror(mcd, mcdret)
+		);
+
+	mcd_set_operation_result(chan, mcdret);
+	mcd_op_done(chan, cluster, mcd, cmd, args.key, key, strlen(args.val), mcdret, start);
+	if (mcdret == MEMCACHED_SUCCESS)
+		mcd_replicate(cluster, cmd, key, args.val, strlen(args.val), (time_t)timeout);
+	free(key);
+	mcd_release(cluster, mcd);
+	return;
+
+}
+
+static int mcdset_exec(struct ast_channel *chan, const char *data) {
+	mcd_putdata("set", chan, data);
+	return 0;
+}
+
+static int mcdadd_exec(struct ast_channel *chan, const char *data) {
+	mcd_putdata("add", chan, data);
+	return 0;
+}
+
+static int mcdreplace_exec(struct ast_channel *chan, const char *data) {
+	mcd_putdata("replace", chan, data);
+	return 0;
+}
+
+static int mcdappend_exec(struct ast_channel *chan, const char *data) {
+	mcd_putdata("append", chan, data);
+	return 0;
+}
+
+static int mcddelete_exec(struct ast_channel *chan, const char *data) {
+
+	char *argcopy;
+	char *key = (char *)ast_malloc(MEMCACHED_MAX_KEY);
+
+	mcd_set_operation_result(chan, MEMCACHED_SUCCESS);
+
+	// parse the app arguments
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(key);
+	);
+	if (ast_strlen_zero(data)) {
+		ast_log(LOG_WARNING, "app mcddelete requires argument (key)\n");
+		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
+		free(key);
+		return 0;
+	}
+	argcopy = ast_strdupa(data);
+	AST_STANDARD_APP_ARGS(args, argcopy);
+	
+	if (ast_strlen_zero(args.key)) {
+		ast_log(LOG_WARNING, "key needed\n");
+		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
+		free(key);
+		return 0;
+	}
+	struct mcd_cluster *cluster;
+	memcached_st *mcd;
+	int keyret = mcd_key_fetch(chan, args.key, &cluster, &mcd, key);
+	if (keyret) {
+		mcd_set_operation_result(chan, keyret);
+		free(key);
+		return 0;
+	}
+	ast_debug(1, "key: %s\n", key);
+
+	struct timeval start = ast_tvnow();
+	memcached_return_t mcdret = mcd_op_delete(cluster, mcd, key);
+	if (mcdret)
+		ast_log(LOG_WARNING, 
+			"memcached_delete() error %d: %s\n", mcdret, memcached_strerror(mcd, mcdret)
+		);
+	mcd_set_operation_result(chan, mcdret);
+	mcd_op_done(chan, cluster, mcd, "delete", args.key, key, 0, mcdret, start);
+	if ((mcdret == MEMCACHED_SUCCESS) || (mcdret == MEMCACHED_NOTFOUND))
+		mcd_replicate(cluster, "delete", key, NULL, 0, (time_t)0);
+	free(key);
+	mcd_release(cluster, mcd);
+	return 0;
+
+}
+
+static int mcdnsbump_exec(struct ast_channel *chan, const char *data) {
+
+	mcd_set_operation_result(chan, MEMCACHED_SUCCESS);
+
+	if (ast_strlen_zero(data)) {
+		ast_log(LOG_WARNING, "app mcdnsbump requires argument (namespace)\n");
+		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
+		return 0;
+	}
+	if (strlen(data) + strlen(NSGEN_KEY_SUFFIX) >= MEMCACHED_MAX_KEY) {
+		ast_log(LOG_WARNING, "namespace name too long: %s\n", data);
+		mcd_set_operation_result(chan, MEMCACHED_KEY_TOO_LONG);
+		return 0;
 	}
-	ast_log(LOG_DEBUG, "timeout: %d\n", timeout);
 
-	memcached_return_t mcdret = MEMCACHED_FAILURE;
-	if (strcmp(cmd, "set") == 0)
-		mcdret = memcached_set(mcd, 
-			key, strlen(key), args.val, strlen(args.val), (time_t)timeout, (uint32_t)0
-		);
-	else if (strcmp(cmd, "add") == 0)
-		mcdret = memcached_add(mcd, 
-			key, strlen(key), args.val, strlen(args.val), (time_t)timeout, (uint32_t)0
-		);
-	else if (strcmp(cmd, "replace") == 0)
-		mcdret = memcached_replace(mcd, 
-			key, strlen(key), args.val, strlen(args.val), (time_t)timeout, (uint32_t)0
-		);
-	else if (strcmp(cmd, "append") == 0)
-		mcdret = memcached_append(mcd, 
-			key, strlen(key), args.val, strlen(args.val), (time_t)timeout, (uint32_t)0
-		);
+	// routed like the keys of the namespace, so that "ns@cluster" and prefix routes both apply
+	char rawkey[MEMCACHED_MAX_KEY], routekey[MEMCACHED_MAX_KEY], genkey[MEMCACHED_MAX_KEY];
+	struct mcd_cluster *cluster;
+	snprintf(rawkey, sizeof(rawkey), "%s", data);
+	char *at = strrchr(rawkey, '@');
+	if (at && (cluster_count > 1) && mcd_cluster_find(at + 1)) {
+		// move the cluster suffix behind the generation key
+		*at = 0;
+		snprintf(routekey, sizeof(routekey), "%s" NSGEN_KEY_SUFFIX "@%s", rawkey, at + 1);
+	} else
+		snprintf(routekey, sizeof(routekey), "%s" NSGEN_KEY_SUFFIX, rawkey);
+	int keyret = mcd_cluster_for_key(chan, routekey, &cluster, genkey);
+	if (keyret) {
+		mcd_set_operation_result(chan, keyret);
+		return 0;
+	}
 
+	memcached_st *mcd;
+	if ((keyret = mcd_fetch(cluster, &mcd))) {
+		mcd_set_operation_result(chan, keyret);
+		return 0;
+	}
+
+	uint64_t newgen = 0;
+	struct timeval start = ast_tvnow();
+	memcached_return_t mcdret = mcd_op_incr(cluster, mcd, genkey, 1, NULL, (time_t)0, &newgen);
+	if (mcdret == MEMCACHED_NOTFOUND) {
+		// no generation yet: any fresh one will do, as long as it is not one used before
+		char initial[24];
+		newgen = (uint64_t)time(NULL);
+		snprintf(initial, sizeof(initial), "%llu", (unsigned long long)newgen);
+		mcdret = mcd_op_store(cluster, mcd, "add", genkey, initial, strlen(initial), (time_t)0, (uint32_t)0);
+		if (mcdret == MEMCACHED_NOTSTORED)
+			mcdret = mcd_op_incr(cluster, mcd, genkey, 1, NULL, (time_t)0, &newgen);
+	}
+	mcd_op_done(chan, cluster, mcd, "increment", rawkey, genkey, 0, mcdret, start);
 	if (mcdret)
 		ast_log(LOG_WARNING, 
-			"memcached_%s() error %d: %s\n", cmd, mcdret, memcached_strerror(mcd, mcdret)
+			"mcdnsbump() error %d: %s\n", mcdret, memcached_strerror(mcd, mcdret)
 		);
-
+	else {
+		ast_debug(1, "namespace %s moved to generation %llu\n", rawkey, (unsigned long long)newgen);
+		mcd_nsgen_cache_store(cluster, rawkey, newgen);
+	}
 	mcd_set_operation_result(chan, mcdret);
-	free(key);
-	memcached_pool_release(mcdpool, mcd);
-	return;
-
-}
-
-static int mcdset_exec(struct ast_channel *chan, const char *data) {
-	mcd_putdata("set", chan, data);
+	mcd_release(cluster, mcd);
 	return 0;
-}
 
-static int mcdadd_exec(struct ast_channel *chan, const char *data) {
-	mcd_putdata("add", chan, data);
-	return 0;
 }
 
-static int mcdreplace_exec(struct ast_channel *chan, const char *data) {
-	mcd_putdata("replace", chan, data);
+static int mcd_vars_put(char **buf, size_t *len, size_t *size, const char *str) {
+// appends a string to a variables snapshot, after its length on two bytes (big endian)
+
+	size_t slen = strlen(str);
+	if (slen > 0xffff)
+		return -1;
+	if (*len + 2 + slen > *size) {
+		size_t newsize = (*size + 2 + slen) * 2;
+		char *newbuf = ast_realloc(*buf, newsize);
+		if (!newbuf)
+			return -1;
+		*buf = newbuf;
+		*size = newsize;
+	}
+	(*buf)[(*len)++] = (slen >> 8) & 0xff;
+	(*buf)[(*len)++] = slen & 0xff;
+	memcpy(*buf + *len, str, slen);
+	*len += slen;
 	return 0;
-}
 
-static int mcdappend_exec(struct ast_channel *chan, const char *data) {
-	mcd_putdata("append", chan, data);
-	return 0;
 }
 
-static int mcddelete_exec(struct ast_channel *chan, const char *data) {
-
-	memcached_return_t rc;
-	memcached_st *mcd = memcached_pool_fetch(mcdpool, &to, &rc);
-	if (rc) {
-        ast_log(LOG_WARNING, "mcddelete_exec: memcached pool error: %d\n", rc);
-		return 0;
-    }
+static int mcdsavevars_exec(struct ast_channel *chan, const char *data) {
 
 	char *argcopy;
-	char *key = (char *)ast_malloc(MEMCACHED_MAX_KEY);
+	unsigned int timeout;
 
 	mcd_set_operation_result(chan, MEMCACHED_SUCCESS);
 
 	// parse the app arguments
 	AST_DECLARE_APP_ARGS(args,
 		AST_APP_ARG(key);
+		AST_APP_ARG(vars);
 	);
 	if (ast_strlen_zero(data)) {
-		ast_log(LOG_WARNING, "app mcddelete requires argument (key)\n");
+		ast_log(LOG_WARNING, "app mcdsavevars requires arguments (key,var1[&var2[&prefix*...]])\n");
 		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
-		free(key);
-		memcached_pool_release(mcdpool, mcd);
 		return 0;
 	}
 	argcopy = ast_strdupa(data);
 	AST_STANDARD_APP_ARGS(args, argcopy);
-	
-	if (ast_strlen_zero(args.key)) {
-		ast_log(LOG_WARNING, "key needed\n");
+	if (ast_strlen_zero(args.key) || ast_strlen_zero(args.vars)) {
+		ast_log(LOG_WARNING, "app mcdsavevars requires arguments (key,var1[&var2[&prefix*...]])\n");
 		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
-		free(key);
-		memcached_pool_release(mcdpool, mcd);
 		return 0;
 	}
-	strcpy(key, args.key);
-	ast_log(LOG_DEBUG, "key: %s\n", key);
 
-	memcached_return_t mcdret = memcached_delete(mcd, key, strlen(key), (time_t)0);
+	// the snapshot: magic, format version, then name / value pairs
+	size_t len = 0, size = 1024;
+	char *buf = ast_malloc(size);
+	if (!buf) {
+		mcd_set_operation_result(chan, MEMCACHED_MEMORY_ALLOCATION_FAILURE);
+		return 0;
+	}
+	memcpy(buf, VARS_MAGIC, strlen(VARS_MAGIC));
+	len = strlen(VARS_MAGIC);
+	buf[len++] = VARS_FORMAT_VERSION;
+
+	int count = 0, failed = 0;
+	char *name, *names = args.vars;
+	while (!failed && (name = strsep(&names, "&"))) {
+		name = ast_strip(name);
+		size_t namelen = strlen(name);
+		if (namelen == 0)
+			continue;
+		if (name[namelen - 1] == '*') {
+			// every channel variable whose name starts with the prefix
+			struct ast_var_t *var;
+			ast_channel_lock(chan);
+			AST_LIST_TRAVERSE(ast_channel_varshead(chan), var, entries) {
+				if (strncasecmp(ast_var_name(var), name, namelen - 1))
+					continue;
+				if (mcd_vars_put(&buf, &len, &size, ast_var_name(var)) || 
+					mcd_vars_put(&buf, &len, &size, ast_var_value(var) ? ast_var_value(var) : "")
+				) {
+					failed = 1;
+					break;
+				}
+				count++;
+			}
+			ast_channel_unlock(chan);
+		} else {
+			const char *value = pbx_builtin_getvar_helper(chan, name);
+			if (!value)
+				continue;
+			if (mcd_vars_put(&buf, &len, &size, name) || mcd_vars_put(&buf, &len, &size, value))
+				failed = 1;
+			else
+				count++;
+		}
+	}
+	if (failed) {
+		ast_log(LOG_WARNING, "mcdsavevars() could not build the snapshot of the variables\n");
+		mcd_set_operation_result(chan, MEMCACHED_MEMORY_ALLOCATION_FAILURE);
+		free(buf);
+		return 0;
+	}
+
+	char key[MEMCACHED_MAX_KEY];
+	struct mcd_cluster *cluster;
+	memcached_st *mcd;
+	int keyret = mcd_key_fetch(chan, args.key, &cluster, &mcd, key);
+	if (keyret) {
+		mcd_set_operation_result(chan, keyret);
+		free(buf);
+		return 0;
+	}
+	timeout = mcd_get_ttl(chan, cluster);
+	ast_debug(1, "saving %d variables (%zu bytes) at %s, timeout %d\n", count, len, key, timeout);
+
+	struct timeval start = ast_tvnow();
+	memcached_return_t mcdret = mcd_op_store(cluster, mcd, "set", key, buf, len, (time_t)timeout, (uint32_t)0);
 	if (mcdret)
 		ast_log(LOG_WARNING, 
-			"memcached_delete() error %d: %s\n", mcdret, memcached_strerror(mcd, mcdret)
+			"mcdsavevars() error %d: %s\n", mcdret, memcached_strerror(mcd, mcdret)
 		);
 	mcd_set_operation_result(chan, mcdret);
-	free(key);
-	memcached_pool_release(mcdpool, mcd);
+	mcd_op_done(chan, cluster, mcd, "set", args.key, key, len, mcdret, start);
+	if (mcdret == MEMCACHED_SUCCESS)
+		mcd_replicate(cluster, "set", key, buf, len, (time_t)timeout);
+	free(buf);
+	mcd_release(cluster, mcd);
+	return 0;
+
+}
+
+static int mcdloadvars_exec(struct ast_channel *chan, const char *data) {
+
+	mcd_set_operation_result(chan, MEMCACHED_SUCCESS);
+
+	if (ast_strlen_zero(data)) {
+		ast_log(LOG_WARNING, "app mcdloadvars requires argument (key)\n");
+		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
+		return 0;
+	}
+	char key[MEMCACHED_MAX_KEY];
+	struct mcd_cluster *cluster;
+	memcached_st *mcd;
+	int keyret = mcd_key_fetch(chan, data, &cluster, &mcd, key);
+	if (keyret) {
+		mcd_set_operation_result(chan, keyret);
+		return 0;
+	}
+
+	memcached_return_t mcdret; size_t szmcdval;
+	char *mcdval = mcd_get_nearest(chan, cluster, mcd, data, key, &szmcdval, &mcdret);
+	if (mcdret) {
+		ast_log(LOG_WARNING, 
+			"mcdloadvars() error %d: %s\n", mcdret, memcached_strerror(mcd, mcdret)
+		);
+		mcd_set_operation_result(chan, mcdret);
+		free(mcdval);
+		mcd_release(cluster, mcd);
+		return 0;
+	}
+	mcd_release(cluster, mcd);
+
+	size_t magiclen = strlen(VARS_MAGIC);
+	if ((szmcdval <= magiclen) || memcmp(mcdval, VARS_MAGIC, magiclen) || (mcdval[magiclen] != VARS_FORMAT_VERSION)) {
+		ast_log(LOG_WARNING, "the value at %s is not a variables snapshot this module can read\n", key);
+		mcd_set_operation_result(chan, MEMCACHED_BAD_SNAPSHOT);
+		free(mcdval);
+		return 0;
+	}
+
+	// check the whole snapshot before setting anything, so that a damaged one sets nothing
+	const unsigned char *pos, *end = (const unsigned char *)mcdval + szmcdval;
+	int count = 0, pass;
+	for (pass = 0; pass < 2; pass++) {
+		pos = (const unsigned char *)mcdval + magiclen + 1;
+		while (pos < end) {
+			char *parts[2];
+			size_t partlen[2];
+			int i;
+			for (i = 0; i < 2; i++) {
+				if ((end - pos < 2) || ((partlen[i] = (pos[0] << 8) | pos[1]) > (size_t)(end - pos - 2)))
+					break;
+				parts[i] = (char *)pos + 2;
+				pos += 2 + partlen[i];
+			}
+			if (i < 2) {
+				ast_log(LOG_WARNING, "the variables snapshot at %s is damaged\n", key);
+				mcd_set_operation_result(chan, MEMCACHED_BAD_SNAPSHOT);
+				free(mcdval);
+				return 0;
+			}
+			if (pass == 0)
+				continue;
+			char *name = ast_strndup(parts[0], partlen[0]), *value = ast_strndup(parts[1], partlen[1]);
+			if (name && value && !ast_strlen_zero(name)) {
+				pbx_builtin_setvar_helper(chan, name, value);
+				count++;
+			}
+			free(name);
+			free(value);
+		}
+	}
+	ast_debug(1, "%d variables restored from %s\n", count, key);
+	free(mcdval);
 	return 0;
 
 }
@@ -779,13 +3193,6 @@ static int mcdcounter_read(
 		return 0;
 	}
 
-	memcached_return_t rc;
-	memcached_st *mcd = memcached_pool_fetch(mcdpool, &to, &rc);
-	if (rc) {
-        ast_log(LOG_WARNING, "mcdcounter_read: memcached pool error: %d\n", rc);
-		return 0;
-    }
-
 	char *argcopy;
 	char *key = (char *)ast_malloc(MEMCACHED_MAX_KEY);
 	int increment = 0; 
@@ -799,7 +3206,6 @@ static int mcdcounter_read(
 		ast_log(LOG_WARNING, "MCDCOUNTER() requires arguments (key[,increment])\n");
 		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
 		free(key);
-		memcached_pool_release(mcdpool, mcd);
 		return 0;
 	}
 	argcopy = ast_strdupa(parse);
@@ -809,35 +3215,40 @@ static int mcdcounter_read(
 		ast_log(LOG_WARNING, "key needed\n");
 		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
 		free(key);
-		memcached_pool_release(mcdpool, mcd);
 		return 0;
 	}
-	strcpy(key, args.key);
-	ast_log(LOG_DEBUG, "key: %s\n", key);
+	struct mcd_cluster *cluster;
+	memcached_st *mcd;
+	int keyret = mcd_key_fetch(chan, args.key, &cluster, &mcd, key);
+	if (keyret) {
+		mcd_set_operation_result(chan, keyret);
+		free(key);
+		return 0;
+	}
+	ast_debug(1, "key: %s\n", key);
 
 	if (!ast_strlen_zero(args.increment))
 		increment = atoi(args.increment);
-	ast_log(LOG_DEBUG, "increment %s by %d\n", key, increment);
+	ast_debug(1, "increment %s by %d\n", key, increment);
 
 	uint64_t newval = 0; 
 	memcached_return_t mcdret;
-	if (increment >= 0)
-		mcdret = memcached_increment(mcd, key, strlen(key), increment, &newval);
-	else
-		mcdret = memcached_decrement(mcd, key, strlen(key), -increment, &newval);
+	struct timeval start = ast_tvnow();
+	mcdret = mcd_op_incr(cluster, mcd, key, increment, NULL, (time_t)0, &newval);
 	if (mcdret)
 		ast_log(LOG_WARNING, 
 			"MCDCOUNTER() error %d: %s\n", mcdret, memcached_strerror(mcd, mcdret)
 		);
 
 	mcd_set_operation_result(chan, mcdret);
+	mcd_op_done(chan, cluster, mcd, increment >= 0 ? "increment" : "decrement", args.key, key, 0, mcdret, start);
 	if (mcdret == MEMCACHED_SUCCESS) {
 		char *newvalstr = NULL;
 		ast_asprintf(&newvalstr, "%d", (int)newval);
 		ast_copy_string(buffer, newvalstr, buflen);
 	}
 	free(key);
-	memcached_pool_release(mcdpool, mcd);
+	mcd_release(cluster, mcd);
 	return 0;
 
 }
@@ -852,53 +3263,556 @@ static int mcdcounter_write(
 		return 0;
 	}
 
-	memcached_return_t rc;
-	memcached_st *mcd = memcached_pool_fetch(mcdpool, &to, &rc);
-	if (rc) {
-        ast_log(LOG_WARNING, "mcdcounter_write: memcached pool error: %d\n", rc);
-		return 0;
-    }
-
 	char *key = (char *)ast_malloc(MEMCACHED_MAX_KEY);
 	unsigned int counter = 0;
-	unsigned int timeout = mcdttl; 
+	unsigned int timeout;
 
 	// the app argument is the key to set
 	if (ast_strlen_zero(parse)) {
 		ast_log(LOG_WARNING, "MCDCOUNTER() requires argument (key)\n");
 		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
 		free(key);
-		memcached_pool_release(mcdpool, mcd);
 		return 0;
 	}
-	strcpy(key, parse);
-	ast_log(LOG_DEBUG, "setting counter in key: %s\n", key);
-
-	const char *ttlval = pbx_builtin_getvar_helper(chan, "MCDTTL");
-	if (ttlval) {
-		timeout = atoi(ttlval);
-		if ((timeout == 0) && (strcmp(ttlval, "0") != 0)) {
-			ast_log(LOG_WARNING, "dialplan variable MCDTTL=%s (not numeric), will use time-to-live value in the config file\n", ttlval);
-			timeout = mcdttl;
-		}
+	struct mcd_cluster *cluster;
+	memcached_st *mcd;
+	int keyret = mcd_key_fetch(chan, parse, &cluster, &mcd, key);
+	if (keyret) {
+		mcd_set_operation_result(chan, keyret);
+		free(key);
+		return 0;
 	}
-	ast_log(LOG_DEBUG, "timeout: %d\n", timeout);
+	ast_debug(1, "setting counter in key: %s\n", key);
+
+	timeout = mcd_get_ttl(chan, cluster);
+	ast_debug(1, "timeout: %d\n", timeout);
 
 	counter = atoi(value);
 	if ((counter == 0) && (strcmp(value, "0") != 0))
 		ast_log(LOG_WARNING, "initializing value %s not numeric, will force to 0\n", value);
-	ast_log(LOG_DEBUG, "counter: %d\n", (unsigned int)counter);
+	ast_debug(1, "counter: %d\n", (unsigned int)counter);
 
 	memcached_return_t mcdret;
 	uint64_t valuenow;
-	mcdret = memcached_increment_with_initial(mcd, key, strlen(key), 0, counter, (time_t)timeout, &valuenow);
+	struct timeval start = ast_tvnow();
+	uint64_t initial = counter;
+	mcdret = mcd_op_incr(cluster, mcd, key, 0, &initial, (time_t)timeout, &valuenow);
 	if (mcdret)
 		ast_log(LOG_WARNING, 
 			"memcached_increment_with_initial() error %d: %s\n", mcdret, memcached_strerror(mcd, mcdret)
 		);
 	mcd_set_operation_result(chan, mcdret);
+	mcd_op_done(chan, cluster, mcd, "increment_with_initial", parse, key, 0, mcdret, start);
 	free(key);
-	memcached_pool_release(mcdpool, mcd);
+	mcd_release(cluster, mcd);
+	return 0;
+
+}
+
+static void mcdcache_eval(struct ast_channel *chan, const char *fallback, char *value) {
+// evaluates the fallback expression of MCDCACHE() into a buffer of MAX_ASTERISK_VARLEN bytes
+
+	char *expr = NULL;
+	ast_asprintf(&expr, "${%s}", fallback);
+	value[0] = 0;
+	if (expr) {
+		pbx_substitute_variables_helper(chan, expr, value, MAX_ASTERISK_VARLEN - 1);
+		free(expr);
+	}
+	ast_debug(1, "MCDCACHE() fallback %s evaluated to '%s'\n", fallback, value);
+
+}
+
+static void mcdcache_refresh(struct ast_channel *chan, struct mcd_cluster *cluster, 
+	const char *key, unsigned int ttl, unsigned int stale, const char *fallback, char *value, int wait
+) {
+// evaluates the fallback and stores the result, under the cross-server lease if we can get it; 
+// if another server holds the lease, wait a while for it to store the value instead (or, when 
+// not asked to wait, leave the value empty). a connection is only taken for each operation on 
+// the servers, never while evaluating or waiting, so that the other calls can have it
+
+	memcached_st *mcd;
+	memcached_return_t mcdret;
+	char leasekey[MEMCACHED_MAX_KEY];
+	int leased = 0;
+	if ((snprintf(leasekey, sizeof(leasekey), "%s" CACHE_LEASE_SUFFIX, key) < (int)sizeof(leasekey)) && 
+		!mcd_fetch(cluster, &mcd)
+	) {
+		mcdret = mcd_op_store(cluster, mcd, "add", leasekey, "1", 1, (time_t)cache_lease, (uint32_t)0);
+		mcd_release(cluster, mcd);
+		if (mcdret == MEMCACHED_SUCCESS)
+			leased = 1;
+		else if ((mcdret == MEMCACHED_NOTSTORED) && !wait) {
+			value[0] = 0;
+			return;
+		} else if (mcdret == MEMCACHED_NOTSTORED) {
+			ast_debug(1, "MCDCACHE() lease for %s held elsewhere, waiting for the value\n", key);
+			struct timeval until = ast_tvadd(ast_tvnow(), ast_samp2tv(cache_lease, 1));
+			while (ast_tvcmp(ast_tvnow(), until) < 0) {
+				usleep(CACHE_LEASE_POLL_MS * 1000);
+				if (mcd_fetch(cluster, &mcd))
+					continue;
+				size_t szmcdval; uint32_t mcdflags;
+				char *mcdval = mcd_op_get(cluster, mcd, key, &szmcdval, &mcdflags, &mcdret);
+				mcd_release(cluster, mcd);
+				if ((mcdret == MEMCACHED_SUCCESS) && (szmcdval < MAX_ASTERISK_VARLEN)) {
+					ast_copy_string(value, mcdval, MAX_ASTERISK_VARLEN);
+					free(mcdval);
+					return;
+				}
+				free(mcdval);
+			}
+			ast_log(LOG_WARNING, "MCDCACHE() lease for %s expired without a value, computing it here\n", key);
+		}
+	}
+
+	mcdcache_eval(chan, fallback, value);
+	if ((ast_strlen_zero(value) && !leased) || mcd_fetch(cluster, &mcd))
+		return;
+	if (!ast_strlen_zero(value)) {
+		// with a stale period, the item lives that much longer in memcached, and the time after 
+		// which it needs a refresh travels in the item flags
+		uint32_t refresh_at = (ttl && stale) ? (uint32_t)(time(NULL) + ttl) : 0;
+		time_t expiration = ttl ? (time_t)(ttl + stale) : 0;
+		struct timeval start = ast_tvnow();
+		mcdret = mcd_op_store(cluster, mcd, "set", 
+			key, value, strlen(value), expiration, refresh_at
+		);
+		mcd_op_done(chan, cluster, mcd, "set", key, key, strlen(value), mcdret, start);
+		if (mcdret)
+			ast_log(LOG_WARNING, 
+				"MCDCACHE() store error %d: %s\n", mcdret, memcached_strerror(mcd, mcdret)
+			);
+	}
+	if (leased)
+		mcd_op_delete(cluster, mcd, leasekey);
+	mcd_release(cluster, mcd);
+
+}
+
+static void mcdcache_flight_release(struct mcd_flight *flight) {
+// must be called with flights_lock held
+	if (--flight->refs == 0) {
+		ast_cond_destroy(&flight->cond);
+		free(flight);
+	}
+}
+
+static int mcdcache_read(
+	struct ast_channel *chan, const char *cmd, char *parse, char *buffer, size_t buflen
+) {
+
+	char *argcopy;
+	unsigned int ttl = 0, stale = 0;
+
+	buffer[0] = 0;
+	mcd_set_operation_result(chan, MEMCACHED_SUCCESS);
+
+	// parse the function arguments
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(key);
+		AST_APP_ARG(ttl);
+		AST_APP_ARG(fallback);
+		AST_APP_ARG(stale);
+	);
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "MCDCACHE() requires arguments (key,ttl,fallback[,stale])\n");
+		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
+		return 0;
+	}
+	argcopy = ast_strdupa(parse);
+	AST_STANDARD_APP_ARGS(args, argcopy);
+
+	if (ast_strlen_zero(args.key) || ast_strlen_zero(args.fallback)) {
+		ast_log(LOG_WARNING, "MCDCACHE() requires arguments (key,ttl,fallback[,stale])\n");
+		mcd_set_operation_result(chan, MEMCACHED_ARGUMENT_NEEDED);
+		return 0;
+	}
+	if (!ast_strlen_zero(args.ttl))
+		ttl = atoi(args.ttl);
+	if (!ast_strlen_zero(args.stale))
+		stale = atoi(args.stale);
+	ast_debug(1, "MCDCACHE() key %s, ttl %d, stale %d\n", args.key, ttl, stale);
+
+	char *value = ast_malloc(MAX_ASTERISK_VARLEN);
+	if (!value) {
+		mcd_set_operation_result(chan, MEMCACHED_MEMORY_ALLOCATION_FAILURE);
+		return 0;
+	}
+
+	// when the cache store cannot be used, the value is still computed, just not cached
+	char key[MEMCACHED_MAX_KEY];
+	struct mcd_cluster *cluster;
+	memcached_st *mcd;
+	int keyret = mcd_key_fetch(chan, args.key, &cluster, &mcd, key);
+	if (keyret) {
+		mcd_set_operation_result(chan, keyret);
+		mcdcache_eval(chan, args.fallback, value);
+		ast_copy_string(buffer, value, buflen);
+		free(value);
+		return 0;
+	}
+
+	memcached_return_t mcdret; size_t szmcdval; uint32_t mcdflags;
+	struct timeval start = ast_tvnow();
+	char *mcdval = mcd_op_get(cluster, mcd, key, &szmcdval, &mcdflags, &mcdret);
+	mcd_op_done(chan, cluster, mcd, "get", args.key, key, mcdret ? 0 : szmcdval, mcdret, start);
+	if ((mcdret != MEMCACHED_SUCCESS) && (mcdret != MEMCACHED_NOTFOUND))
+		ast_log(LOG_WARNING, 
+			"MCDCACHE() error %d: %s\n", mcdret, memcached_strerror(mcd, mcdret)
+		);
+	mcd_release(cluster, mcd);
+
+	struct mcd_flight *flight;
+	if ((mcdret == MEMCACHED_SUCCESS) && (szmcdval < MAX_ASTERISK_VARLEN)) {
+		ast_copy_string(buffer, mcdval, buflen);
+		free(mcdval);
+		if ((mcdflags == 0) || ((uint32_t)time(NULL) < mcdflags)) {
+			free(value);
+			return 0;
+		}
+		// stale: whoever gets here first on this server refreshes it, everybody else returns 
+		// the stale value right away
+		ast_mutex_lock(&flights_lock);
+		AST_LIST_TRAVERSE(&mcd_flights, flight, list)
+			if ((flight->cluster == cluster) && (strcmp(flight->key, key) == 0))
+				break;
+		if (flight || !(flight = ast_calloc(1, sizeof(*flight)))) {
+			ast_mutex_unlock(&flights_lock);
+			free(value);
+			return 0;
+		}
+		flight->cluster = cluster;
+		ast_copy_string(flight->key, key, sizeof(flight->key));
+		flight->refs = 1;
+		ast_cond_init(&flight->cond, NULL);
+		AST_LIST_INSERT_HEAD(&mcd_flights, flight, list);
+		ast_mutex_unlock(&flights_lock);
+
+		mcdcache_refresh(chan, cluster, key, ttl, stale, args.fallback, value, 0);
+		if (!ast_strlen_zero(value))
+			ast_copy_string(buffer, value, buflen);
+
+		// somebody may have missed the key in the mean time, and joined the flight
+		ast_mutex_lock(&flights_lock);
+		ast_copy_string(flight->value, buffer, sizeof(flight->value));
+		flight->done = 1;
+		ast_cond_broadcast(&flight->cond);
+		AST_LIST_REMOVE(&mcd_flights, flight, list);
+		mcdcache_flight_release(flight);
+		ast_mutex_unlock(&flights_lock);
+		free(value);
+		return 0;
+	}
+	free(mcdval);
+
+	// miss: join the flight for this key, or start one
+	ast_mutex_lock(&flights_lock);
+	AST_LIST_TRAVERSE(&mcd_flights, flight, list)
+		if ((flight->cluster == cluster) && (strcmp(flight->key, key) == 0))
+			break;
+	if (flight) {
+		flight->refs++;
+		struct timeval until = ast_tvadd(ast_tvnow(), ast_samp2tv(cache_lease, 1));
+		struct timespec ts = { .tv_sec = until.tv_sec, .tv_nsec = until.tv_usec * 1000 };
+		while (!flight->done) 
+			if (ast_cond_timedwait(&flight->cond, &flights_lock, &ts) == ETIMEDOUT)
+				break;
+		int done = flight->done;
+		if (done)
+			ast_copy_string(buffer, flight->value, buflen);
+		mcdcache_flight_release(flight);
+		ast_mutex_unlock(&flights_lock);
+		if (!done) {
+			ast_log(LOG_WARNING, "MCDCACHE() gave up waiting for %s, computing it here\n", key);
+			mcdcache_eval(chan, args.fallback, value);
+			ast_copy_string(buffer, value, buflen);
+		}
+		free(value);
+		return 0;
+	}
+	if ((flight = ast_calloc(1, sizeof(*flight)))) {
+		flight->cluster = cluster;
+		ast_copy_string(flight->key, key, sizeof(flight->key));
+		flight->refs = 1;
+		ast_cond_init(&flight->cond, NULL);
+		AST_LIST_INSERT_HEAD(&mcd_flights, flight, list);
+	}
+	ast_mutex_unlock(&flights_lock);
+
+	mcdcache_refresh(chan, cluster, key, ttl, stale, args.fallback, value, 1);
+	ast_copy_string(buffer, value, buflen);
+
+	if (flight) {
+		ast_mutex_lock(&flights_lock);
+		ast_copy_string(flight->value, value, sizeof(flight->value));
+		flight->done = 1;
+		ast_cond_broadcast(&flight->cond);
+		AST_LIST_REMOVE(&mcd_flights, flight, list);
+		mcdcache_flight_release(flight);
+		ast_mutex_unlock(&flights_lock);
+	}
+
+	free(value);
+	return 0;
+
+}
+
+static void *mcd_sorcery_open(const char *data) {
+// called for every object type mapped to the wizard in sorcery.conf; data holds the options
+
+	struct mcd_sorcery_type *type = ast_calloc(1, sizeof(*type));
+	if (!type)
+		return NULL;
+	type->expire = sorcery_expire;
+
+	if (!ast_strlen_zero(data)) {
+		char *options = ast_strdupa(data), *option;
+		while ((option = strsep(&options, ","))) {
+			char *name = strsep(&option, "=");
+			if (!strcasecmp(ast_strip(name), "expire") && !ast_strlen_zero(option))
+				type->expire = atoi(option);
+			else
+				ast_log(LOG_WARNING, "unknown memcached sorcery wizard option '%s'\n", name);
+		}
+	}
+	ast_debug(1, "memcached sorcery wizard opened, objects expire after %d seconds\n", type->expire);
+	return type;
+
+}
+
+static void mcd_sorcery_close(void *data) {
+	free(data);
+}
+
+static int mcd_sorcery_key(
+	const char *type, const char *id, struct mcd_cluster **cluster, memcached_st **mcd, char *key
+) {
+// builds the key for an object and fetches a handle for its cluster; ids with blanks or control characters cannot be keys
+
+	const char *c;
+	for (c = id; *c; c++)
+		if ((unsigned char)*c <= ' ')
+			return MEMCACHED_BAD_KEY_PROVIDED;
+	char rawkey[MEMCACHED_MAX_KEY];
+	if (snprintf(rawkey, sizeof(rawkey), SORCERY_KEY_PREFIX "%s:%s", type, id) >= (int)sizeof(rawkey))
+		return MEMCACHED_KEY_TOO_LONG;
+	return mcd_key_fetch(NULL, rawkey, cluster, mcd, key);
+
+}
+
+static int mcd_sorcery_create(const struct ast_sorcery *sorcery, void *data, void *object) {
+// stores an object; as a cache, this is called for every object retrieved from the backend
+
+	struct mcd_sorcery_type *type = data;
+	struct ast_variable *fields, *field;
+	struct ast_str *buf;
+
+	if (!(fields = ast_sorcery_objectset_create(sorcery, object)))
+		return -1;
+	if (!(buf = ast_str_create(1024))) {
+		ast_variables_destroy(fields);
+		return -1;
+	}
+	for (field = fields; field; field = field->next)
+		ast_str_append(&buf, 0, "%zu:%s%zu:%s", 
+			strlen(field->name), field->name, strlen(field->value), field->value
+		);
+	ast_variables_destroy(fields);
+
+	struct mcd_cluster *cluster;
+	memcached_st *mcd = NULL;
+	char key[MEMCACHED_MAX_KEY];
+	int mcdret = mcd_sorcery_key(
+		ast_sorcery_object_get_type(object), ast_sorcery_object_get_id(object), &cluster, &mcd, key
+	);
+	if (mcdret == MEMCACHED_SUCCESS) {
+		struct timeval start = ast_tvnow();
+		mcdret = mcd_op_store(cluster, mcd, "set", 
+			key, ast_str_buffer(buf), ast_str_strlen(buf), (time_t)type->expire, (uint32_t)0
+		);
+		mcd_op_done(NULL, cluster, mcd, "set", key, key, ast_str_strlen(buf), mcdret, start);
+	}
+	if (mcdret)
+		ast_log(LOG_WARNING, 
+			"sorcery object %s/%s not cached, error %d\n", 
+			ast_sorcery_object_get_type(object), ast_sorcery_object_get_id(object), mcdret
+		);
+	else
+		ast_debug(1, "sorcery object cached at %s (%zu bytes)\n", key, ast_str_strlen(buf));
+
+	free(buf);
+	mcd_release(cluster, mcd);
+	return mcdret ? -1 : 0;
+
+}
+
+static struct ast_variable *mcd_sorcery_parse(const char *buf, size_t len) {
+// turns a serialized object set back into a list of variables; NULL if anything is off
+
+	struct ast_variable *fields = NULL, *last = NULL;
+	const char *end = buf + len;
+
+	while (buf < end) {
+		char *parts[2];
+		int i;
+		for (i = 0; i < 2; i++) {
+			char *colon;
+			unsigned long partlen = strtoul(buf, &colon, 10);
+			if ((colon == buf) || (colon >= end) || (*colon != ':') || (partlen > (unsigned long)(end - colon - 1)) || 
+				!(parts[i] = ast_malloc(partlen + 1))
+			) {
+				ast_variables_destroy(fields);
+				if (i)
+					free(parts[0]);
+				return NULL;
+			}
+			memcpy(parts[i], colon + 1, partlen);
+			parts[i][partlen] = 0;
+			buf = colon + 1 + partlen;
+		}
+		struct ast_variable *field = ast_variable_new(parts[0], parts[1], "");
+		free(parts[0]); free(parts[1]);
+		if (!field) {
+			ast_variables_destroy(fields);
+			return NULL;
+		}
+		if (last)
+			last->next = field;
+		else
+			fields = field;
+		last = field;
+	}
+	return fields;
+
+}
+
+static void *mcd_sorcery_retrieve_id(
+	const struct ast_sorcery *sorcery, void *data, const char *type, const char *id
+) {
+
+	struct mcd_cluster *cluster;
+	memcached_st *mcd;
+	char key[MEMCACHED_MAX_KEY];
+	if (mcd_sorcery_key(type, id, &cluster, &mcd, key))
+		return NULL;
+
+	memcached_return_t mcdret; size_t szmcdval; uint32_t mcdflags;
+	struct timeval start = ast_tvnow();
+	char *mcdval = mcd_op_get(cluster, mcd, key, &szmcdval, &mcdflags, &mcdret);
+	mcd_op_done(NULL, cluster, mcd, "get", key, key, mcdret ? 0 : szmcdval, mcdret, start);
+	mcd_release(cluster, mcd);
+	if (mcdret) {
+		if (mcdret != MEMCACHED_NOTFOUND)
+			ast_log(LOG_WARNING, 
+				"sorcery object %s/%s lookup error %d\n", type, id, mcdret
+			);
+		free(mcdval);
+		return NULL;
+	}
+
+	struct ast_variable *fields = mcd_sorcery_parse(mcdval, szmcdval);
+	free(mcdval);
+	if (!fields) {
+		ast_log(LOG_WARNING, "sorcery object cached at %s is damaged, ignoring it\n", key);
+		return NULL;
+	}
+
+	void *object = ast_sorcery_alloc(sorcery, type, id);
+	if (object && ast_sorcery_objectset_apply(sorcery, object, fields)) {
+		ast_log(LOG_WARNING, "sorcery object cached at %s does not apply, ignoring it\n", key);
+		ao2_ref(object, -1);
+		object = NULL;
+	}
+	ast_variables_destroy(fields);
+	return object;
+
+}
+
+static int mcd_sorcery_delete(const struct ast_sorcery *sorcery, void *data, void *object) {
+// on delete, and also on update: the next retrieval caches the object again from the backend
+
+	struct mcd_cluster *cluster;
+	memcached_st *mcd = NULL;
+	char key[MEMCACHED_MAX_KEY];
+	int mcdret = mcd_sorcery_key(
+		ast_sorcery_object_get_type(object), ast_sorcery_object_get_id(object), &cluster, &mcd, key
+	);
+	if (mcdret == MEMCACHED_SUCCESS) {
+		struct timeval start = ast_tvnow();
+		mcdret = mcd_op_delete(cluster, mcd, key);
+		mcd_op_done(NULL, cluster, mcd, "delete", key, key, 0, mcdret, start);
+		if (mcdret == MEMCACHED_NOTFOUND)
+			mcdret = MEMCACHED_SUCCESS;
+	}
+	if (mcdret)
+		ast_log(LOG_WARNING, 
+			"sorcery object %s/%s not invalidated, error %d\n", 
+			ast_sorcery_object_get_type(object), ast_sorcery_object_get_id(object), mcdret
+		);
+
+	mcd_release(cluster, mcd);
+	return mcdret ? -1 : 0;
+
+}
+
+static struct ast_sorcery_wizard mcd_sorcery_wizard = {
+	.name = "memcached",
+	.open = mcd_sorcery_open,
+	.create = mcd_sorcery_create,
+	.retrieve_id = mcd_sorcery_retrieve_id,
+	.update = mcd_sorcery_delete,
+	.delete = mcd_sorcery_delete,
+	.close = mcd_sorcery_close,
+};
+
+static int mcdtrace_read(
+	struct ast_channel *chan, const char *cmd, char *parse, char *buffer, size_t buflen
+) {
+
+	buffer[0] = 0;
+	if (!chan) {
+		ast_log(LOG_WARNING, "No channel was provided to %s function.\n", cmd);
+		return -1;
+	}
+	ast_channel_lock(chan);
+	struct ast_datastore *datastore = ast_channel_datastore_find(chan, &mcd_trace_info, NULL);
+	if (datastore) {
+		struct mcd_trace *trace = datastore->data;
+		snprintf(buffer, buflen, "ops=%lu total=%lldus max=%lldus", 
+			trace->ops, (long long)trace->total_us, (long long)trace->max_us
+		);
+	}
+	ast_channel_unlock(chan);
+	return 0;
+
+}
+
+static int mcdtrace_write(
+	struct ast_channel *chan, const char *cmd, char *parse, const char *value
+) {
+
+	if (!chan) {
+		ast_log(LOG_WARNING, "No channel was provided to %s function.\n", cmd);
+		return -1;
+	}
+	ast_channel_lock(chan);
+	struct ast_datastore *datastore = ast_channel_datastore_find(chan, &mcd_trace_info, NULL);
+	if (ast_true(value) && !datastore) {
+		struct mcd_trace *trace = ast_calloc(1, sizeof(*trace));
+		if (trace && (datastore = ast_datastore_alloc(&mcd_trace_info, NULL))) {
+			datastore->data = trace;
+			ast_atomic_fetchadd_int(&trace_channels, 1);
+			ast_channel_datastore_add(chan, datastore);
+			ast_debug(1, "memcached tracing on for %s\n", ast_channel_name(chan));
+		} else
+			free(trace);
+	} else if (!ast_true(value) && datastore) {
+		ast_channel_datastore_remove(chan, datastore);
+		ast_datastore_free(datastore);
+		ast_debug(1, "memcached tracing off for %s\n", ast_channel_name(chan));
+	}
+	ast_channel_unlock(chan);
 	return 0;
 
 }
@@ -915,8 +3829,21 @@ static struct ast_custom_function acf_mcdcounter = {
 	.write = mcdcounter_write
 };
 
+static struct ast_custom_function acf_mcdcache = {
+	.name = "MCDCACHE",
+	.read = mcdcache_read
+};
+
+static struct ast_custom_function acf_mcdtrace = {
+	.name = "MCDTRACE",
+	.read = mcdtrace_read,
+	.write = mcdtrace_write
+};
+
 static int load_module(void) {
 	int ret = 0;
+	ast_cond_init(&repl_cond, NULL);
+	ast_cond_init(&keepalive_cond, NULL);
 	ret = mcd_load_config();
 	ret |= ast_custom_function_register(&acf_mcd);
 	ret |= ast_register_application_xml(app_mcdget, mcdget_exec);
@@ -925,13 +3852,23 @@ static int load_module(void) {
 	ret |= ast_register_application_xml(app_mcdreplace, mcdreplace_exec);
 	ret |= ast_register_application_xml(app_mcdappend, mcdappend_exec);
 	ret |= ast_register_application_xml(app_mcddelete, mcddelete_exec);
+	ret |= ast_register_application_xml(app_mcdnsbump, mcdnsbump_exec);
+	ret |= ast_register_application_xml(app_mcdsavevars, mcdsavevars_exec);
+	ret |= ast_register_application_xml(app_mcdloadvars, mcdloadvars_exec);
 	ret |= ast_custom_function_register(&acf_mcdcounter);
+	ret |= ast_custom_function_register(&acf_mcdcache);
+	ret |= ast_custom_function_register(&acf_mcdtrace);
+	ret |= ast_sorcery_wizard_register(&mcd_sorcery_wizard);
+	ret |= ast_cli_register_multiple(cli_memcached, ARRAY_LEN(cli_memcached));
+	ret |= ast_manager_register_xml("MemcachedServers", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING, manager_mcd_servers);
 	return ret;
 }
 
 static int unload_module(void) {
-	memcached_pool_destroy(mcdpool);
 	int ret = 0;
+	ret |= ast_manager_unregister("MemcachedServers");
+	ret |= ast_cli_unregister_multiple(cli_memcached, ARRAY_LEN(cli_memcached));
+	ret |= ast_sorcery_wizard_unregister(&mcd_sorcery_wizard);
 	ret |= ast_custom_function_unregister(&acf_mcd);
 	ret |= ast_unregister_application(app_mcdset);
 	ret |= ast_unregister_application(app_mcdget);
@@ -939,7 +3876,18 @@ static int unload_module(void) {
 	ret |= ast_unregister_application(app_mcdreplace);
 	ret |= ast_unregister_application(app_mcdappend);
 	ret |= ast_unregister_application(app_mcddelete);
+	ret |= ast_unregister_application(app_mcdnsbump);
+	ret |= ast_unregister_application(app_mcdsavevars);
+	ret |= ast_unregister_application(app_mcdloadvars);
 	ret |= ast_custom_function_unregister(&acf_mcdcounter);
+	ret |= ast_custom_function_unregister(&acf_mcdcache);
+	ret |= ast_custom_function_unregister(&acf_mcdtrace);
+	// nothing can reach the clusters any more: stop the threads, then free them
+	mcd_keepalive_stop();
+	mcd_repl_stop();
+	mcd_clusters_destroy();
+	ast_cond_destroy(&repl_cond);
+	ast_cond_destroy(&keepalive_cond);
 	return ret;
 }
 